@@ -1,5 +1,6 @@
 #define LLAMAMODEL_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
 #include "llamamodel_impl.h"
+#include "sampler.h"
 
 #include <cassert>
 #include <cmath>
@@ -40,12 +41,6 @@ struct gpt_params {
     int32_t n_parts       = -1;   // amount of model parts (-1 = determine from model dimensions)
 #endif
 
-#if LLAMA_DATE >= 230519
-    // sampling parameters
-    float   tfs_z         = 1.0f; // 1.0 = disabled
-    float   typical_p     = 1.0f; // 1.0 = disabled
-#endif
-
     std::string prompt = "";
 
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
@@ -54,42 +49,14 @@ struct gpt_params {
     bool use_mlock         = false; // use mlock to keep model in memory
 };
 
-#if LLAMA_DATE >= 230519
-static int llama_sample_top_p_top_k(
-        llama_context *ctx,
-        const llama_token *last_n_tokens_data,
-        int last_n_tokens_size,
-        int top_k,
-        float top_p,
-        float temp,
-        float repeat_penalty) {
-    auto logits = llama_get_logits(ctx);
-    auto n_vocab = llama_n_vocab(ctx);
-    // Populate initial list of all candidates
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
-    for (int token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-    // Sample repeat penalty
-    llama_sample_repetition_penalty(nullptr, &candidates_p, last_n_tokens_data, last_n_tokens_size, repeat_penalty);
-    // Temperature sampling
-    llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-    llama_sample_tail_free(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_typical(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-    llama_sample_temperature(ctx, &candidates_p, temp);
-    return llama_sample_token(ctx, &candidates_p);
-}
-#endif
-
 struct LLamaPrivate {
     const std::string modelPath;
     bool modelLoaded;
     llama_context *ctx = nullptr;
     llama_context_params params;
     int64_t n_threads = 0;
+    std::mt19937 rng;
+    gpt_sampler_buffers sampler;
 };
 
 LLamaModel::LLamaModel()
@@ -99,11 +66,14 @@ LLamaModel::LLamaModel()
 
 bool LLamaModel::loadModel(const std::string &modelPath)
 {
+    std::mt19937 rng(time(NULL));
+    d_ptr->rng = rng;
+
     // load the model
     d_ptr->params = llama_context_default_params();
 
     gpt_params params;
-    d_ptr->params.n_ctx      = 2048;
+    d_ptr->params.n_ctx      = m_loadOptions.n_ctx > 0 ? m_loadOptions.n_ctx : 2048;
     d_ptr->params.seed       = params.seed;
     d_ptr->params.f16_kv     = params.memory_f16;
     d_ptr->params.use_mmap   = params.use_mmap;
@@ -184,25 +154,30 @@ std::string LLamaModel::tokenToString(Token id) const
 
 LLModel::Token LLamaModel::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return llama_sample_top_p_top_k(d_ptr->ctx,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks, promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty);
+    return gpt_sample_token(promptCtx, promptCtx.logits.data(), promptCtx.logits.size(),
+        d_ptr->rng, d_ptr->sampler);
 }
 
 bool LLamaModel::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
     // When we recalculate context we could have erased the original BOS token... we need to replace it
     const bool useBOS = ctx.n_past == 0 && (ctx.tokens.empty() || ctx.tokens.front() != llama_token_bos());
+    bool ok;
     if (useBOS) {
         std::vector<int32_t> myTokens;
         myTokens.push_back(llama_token_bos());
         myTokens.insert(myTokens.end(), tokens.begin(), tokens.end());
         ctx.n_past += 1;
-        return llama_eval(d_ptr->ctx, myTokens.data(), myTokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
+        ok = llama_eval(d_ptr->ctx, myTokens.data(), myTokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
     } else
-        return llama_eval(d_ptr->ctx, tokens.data(), tokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
+        ok = llama_eval(d_ptr->ctx, tokens.data(), tokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
+
+    // keep the logits with the context like the other implementations do, they are sampled from there
+    if (ok) {
+        const float *logits = llama_get_logits(d_ptr->ctx);
+        ctx.logits.assign(logits, logits + llama_n_vocab(d_ptr->ctx));
+    }
+    return ok;
 }
 
 int32_t LLamaModel::contextLength() const
@@ -235,6 +210,16 @@ DLL_EXPORT const char *get_build_variant() {
     return GGML_BUILD_VARIANT;
 }
 
+DLL_EXPORT void get_file_signature(uint32_t *magic, uint32_t *min_version, uint32_t *max_version) {
+    *magic = 0x67676a74;
+    // the range of file versions LLAMA_VERSIONS accepts, which are small numbers
+    uint32_t version = 0;
+    while (!(version LLAMA_VERSIONS)) ++version;
+    *min_version = version;
+    while (version < 64 && ((version + 1) LLAMA_VERSIONS)) ++version;
+    *max_version = version < 64 ? version : std::numeric_limits<uint32_t>::max();
+}
+
 DLL_EXPORT bool magic_match(std::istream& f) {
     // Check magic
     uint32_t magic = 0;
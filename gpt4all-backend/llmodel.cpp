@@ -8,6 +8,9 @@
 #include <filesystem>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
 #include <sstream>
 
 std::string s_implementations_search_path = ".";
@@ -40,25 +43,29 @@ static bool requires_avxonly() {
 #endif
 }
 
-LLModel::Implementation::Implementation(Dlhandle &&dlhandle_) : dlhandle(new Dlhandle(std::move(dlhandle_))) {
-    auto get_model_type = dlhandle->get<const char *()>("get_model_type");
-    assert(get_model_type);
-    modelType = get_model_type();
-    auto get_build_variant = dlhandle->get<const char *()>("get_build_variant");
-    assert(get_build_variant);
-    buildVariant = get_build_variant();
+LLModel::Implementation::Implementation(Dlhandle &&dlhandle_, Signature &&signature)
+    : modelType(signature.modelType)
+    , buildVariant(signature.buildVariant)
+    , dlhandle(new Dlhandle(std::move(dlhandle_)))
+    , m_signature(std::move(signature)) {
     magicMatch = dlhandle->get<bool(std::ifstream&)>("magic_match");
     assert(magicMatch);
     construct_ = dlhandle->get<LLModel *()>("construct");
     assert(construct_);
 }
 
+LLModel::Implementation::Implementation(Signature &&signature)
+    : modelType(signature.modelType)
+    , buildVariant(signature.buildVariant)
+    , m_signature(std::move(signature)) {}
+
 LLModel::Implementation::Implementation(Implementation &&o)
-    : construct_(o.construct_)
-    , modelType(o.modelType)
-    , buildVariant(o.buildVariant)
+    : modelType(std::move(o.modelType))
+    , buildVariant(std::move(o.buildVariant))
     , magicMatch(o.magicMatch)
-    , dlhandle(o.dlhandle) {
+    , dlhandle(o.dlhandle)
+    , m_signature(std::move(o.m_signature))
+    , construct_(o.construct_) {
     o.dlhandle = nullptr;
 }
 
@@ -70,36 +77,177 @@ bool LLModel::Implementation::isImplementation(const Dlhandle &dl) {
     return dl.get<bool(uint32_t)>("is_g4a_backend_model_implementation");
 }
 
+bool LLModel::Implementation::headerMatch(const char *header) const {
+    if (!m_signature.hasMagic)
+        return true;
+    uint32_t magic, version;
+    memcpy(&magic, header, sizeof(magic));
+    memcpy(&version, header + sizeof(magic), sizeof(version));
+    return magic == m_signature.magic && version >= m_signature.minVersion && version <= m_signature.maxVersion;
+}
+
+bool LLModel::Implementation::load() const {
+    if (dlhandle)
+        return true;
+    try {
+        Dlhandle dl(m_signature.path);
+        auto magic_match = dl.get<bool(std::ifstream&)>("magic_match");
+        auto construct = dl.get<LLModel *()>("construct");
+        if (!magic_match || !construct)
+            return false;
+        magicMatch = magic_match;
+        construct_ = construct;
+        dlhandle = new Dlhandle(std::move(dl));
+    } catch (const Dlhandle::Exception &e) {
+        std::cerr << "llmodel: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The manifest lives in the user's cache directory and lists every library found in the search paths
+// along with its signature; it is shared by all search paths and keyed by the full path of the library
+static std::filesystem::path manifest_path() {
+    const char *dir;
+#if defined(_WIN32)
+    if ((dir = getenv("LOCALAPPDATA")))
+        return std::filesystem::path(dir) / "gpt4all" / "implementations.manifest";
+#elif defined(__APPLE__)
+    if ((dir = getenv("HOME")))
+        return std::filesystem::path(dir) / "Library" / "Caches" / "gpt4all" / "implementations.manifest";
+#else
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        return std::filesystem::path(dir) / "gpt4all" / "implementations.manifest";
+    if ((dir = getenv("HOME")))
+        return std::filesystem::path(dir) / ".cache" / "gpt4all" / "implementations.manifest";
+#endif
+    return {};
+}
+
+static const char *s_manifest_header = "# gpt4all implementations manifest v1";
+
+static std::map<std::string, LLModel::Implementation::Signature> read_manifest(const std::filesystem::path &path) {
+    std::map<std::string, LLModel::Implementation::Signature> fres;
+    std::ifstream f(path);
+    std::string line;
+    if (!f || !std::getline(f, line) || line != s_manifest_header)
+        return fres;
+    // mtime, size, is implementation, model type, build variant, has magic, magic, versions, path
+    while (std::getline(f, line)) {
+        LLModel::Implementation::Signature sig;
+        std::istringstream ss(line);
+        int isImplementation, hasMagic;
+        ss >> sig.mtime >> sig.size >> isImplementation >> sig.modelType >> sig.buildVariant >> hasMagic
+           >> sig.magic >> sig.minVersion >> sig.maxVersion;
+        ss.ignore(1);
+        if (!ss || !std::getline(ss, sig.path))
+            continue;
+        sig.isImplementation = isImplementation;
+        sig.hasMagic = hasMagic;
+        fres[sig.path] = std::move(sig);
+    }
+    return fres;
+}
+
+static void write_manifest(const std::filesystem::path &path,
+                           const std::map<std::string, LLModel::Implementation::Signature> &signatures) {
+    // other processes may read the manifest meanwhile, so it is replaced as a whole
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    auto tmp = path;
+    tmp += "." + std::to_string(std::random_device()());
+    {
+        std::ofstream f(tmp);
+        if (!f)
+            return;
+        f << s_manifest_header << '\n';
+        for (const auto &[p, sig] : signatures) {
+            // the strings must not be empty to be read back
+            f << sig.mtime << ' ' << sig.size << ' ' << sig.isImplementation << ' '
+              << (sig.modelType.empty() ? "-" : sig.modelType) << ' '
+              << (sig.buildVariant.empty() ? "-" : sig.buildVariant) << ' ' << sig.hasMagic << ' '
+              << sig.magic << ' ' << sig.minVersion << ' ' << sig.maxVersion << ' ' << sig.path << '\n';
+        }
+        if (!f)
+            return;
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+        std::filesystem::remove(tmp, ec);
+}
+
+// Loads a library not in the manifest to learn its signature; returns false if it can't be loaded
+static bool probe_library(LLModel::Implementation::Signature &sig, std::vector<LLModel::Implementation> &impls) {
+    try {
+        Dlhandle dl(sig.path);
+        sig.isImplementation = LLModel::Implementation::isImplementation(dl);
+        if (!sig.isImplementation)
+            return true;
+        auto get_model_type = dl.get<const char *()>("get_model_type");
+        assert(get_model_type);
+        sig.modelType = get_model_type();
+        auto get_build_variant = dl.get<const char *()>("get_build_variant");
+        assert(get_build_variant);
+        sig.buildVariant = get_build_variant();
+        // libraries that don't describe their model files are always asked through magic_match
+        auto get_file_signature = dl.get<void(uint32_t *, uint32_t *, uint32_t *)>("get_file_signature");
+        sig.hasMagic = get_file_signature;
+        if (get_file_signature)
+            get_file_signature(&sig.magic, &sig.minVersion, &sig.maxVersion);
+        impls.emplace_back(std::move(dl), LLModel::Implementation::Signature(sig));
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
 const std::vector<LLModel::Implementation> &LLModel::implementationList() {
     // NOTE: allocated on heap so we leak intentionally on exit so we have a chance to clean up the
     // individual models without the cleanup of the static list interfering
     static auto* libs = new std::vector<LLModel::Implementation>([] () {
         std::vector<LLModel::Implementation> fres;
 
+        // libraries are only loaded if they aren't in the manifest or changed since
+        const auto manifestPath = manifest_path();
+        std::map<std::string, Implementation::Signature> manifest;
+        if (!manifestPath.empty())
+            manifest = read_manifest(manifestPath);
+        bool changed = false;
+
         auto search_in_directory = [&](const std::string& paths) {
             std::stringstream ss(paths);
             std::string path;
             // Split the paths string by the delimiter and process each path.
             while (std::getline(ss, path, ';')) {
                 std::filesystem::path fs_path(path);
+                std::error_code ec;
                 // Iterate over all libraries
-                for (const auto& f : std::filesystem::directory_iterator(fs_path)) {
+                for (const auto& f : std::filesystem::directory_iterator(fs_path, ec)) {
                     const std::filesystem::path& p = f.path();
                     if (p.extension() != LIB_FILE_EXT) continue;
-                    // Add to list if model implementation
-                    try {
-                        Dlhandle dl(p.string());
-                        if (!Implementation::isImplementation(dl)) {
-                            continue;
-                        }
-                        fres.emplace_back(Implementation(std::move(dl)));
-                    } catch (...) {}
+                    Implementation::Signature sig;
+                    sig.path = std::filesystem::absolute(p, ec).string();
+                    sig.mtime = f.last_write_time(ec).time_since_epoch().count();
+                    sig.size = f.file_size(ec);
+                    auto known = manifest.find(sig.path);
+                    if (known != manifest.end() && known->second.mtime == sig.mtime && known->second.size == sig.size) {
+                        if (known->second.isImplementation)
+                            fres.emplace_back(Implementation::Signature(known->second));
+                        continue;
+                    }
+                    if (!probe_library(sig, fres))
+                        continue;
+                    manifest[sig.path] = sig;
+                    changed = true;
                 }
             }
         };
 
         search_in_directory(s_implementations_search_path);
 
+        if (changed && !manifestPath.empty())
+            write_manifest(manifestPath, manifest);
+
         return fres;
     }());
     // Return static result
@@ -107,10 +255,16 @@ const std::vector<LLModel::Implementation> &LLModel::implementationList() {
 }
 
 const LLModel::Implementation* LLModel::implementation(std::ifstream& f, const std::string& buildVariant) {
+    char header[8] = {};
+    f.seekg(0);
+    f.read(header, sizeof(header));
+    f.clear();
     for (const auto& i : implementationList()) {
+        if (buildVariant != i.buildVariant) continue;
+        if (!i.headerMatch(header)) continue;
+        if (!i.load()) continue;
         f.seekg(0);
         if (!i.magicMatch(f)) continue;
-        if (buildVariant != i.buildVariant) continue;
         return &i;
     }
     return nullptr;
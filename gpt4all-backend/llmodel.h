@@ -4,11 +4,14 @@
 #include <string>
 #include <functional>
 #include <vector>
+#include <utility>
 #include <string_view>
 #include <fstream>
 #include <cstdint>
 #include <limits>
 
+#include "stopsequences.h"
+
 class Dlhandle;
 
 class LLModel {
@@ -16,31 +19,59 @@ public:
     using Token = int32_t;
 
     class Implementation {
-        LLModel *(*construct_)();
-
     public:
-        Implementation(Dlhandle&&);
+        // What the manifest of the search path remembers about a library, so that it only has to be
+        // loaded once it is known to be able to read a model file
+        struct Signature {
+            std::string path;
+            int64_t mtime = 0;
+            uint64_t size = 0;
+            bool isImplementation = false;
+            std::string modelType, buildVariant;
+            bool hasMagic = false;      // false if the library doesn't describe its file format
+            uint32_t magic = 0;         // first four bytes of its model files
+            uint32_t minVersion = 0;    // range of the four bytes after them
+            uint32_t maxVersion = std::numeric_limits<uint32_t>::max();
+        };
+
+        Implementation(Dlhandle&&, Signature&&);
+        Implementation(Signature&&);
         Implementation(const Implementation&) = delete;
         Implementation(Implementation&&);
         ~Implementation();
 
         static bool isImplementation(const Dlhandle&);
 
-        std::string_view modelType, buildVariant;
-        bool (*magicMatch)(std::ifstream& f);
-        Dlhandle *dlhandle;
+        // Whether a model file starting with these 8 bytes could be for this implementation; this only
+        // consults the signature and doesn't load the library
+        bool headerMatch(const char *header) const;
+        // Loads the library if that hasn't happened yet
+        bool load() const;
+
+        const Signature &signature() const { return m_signature; }
+
+        std::string modelType, buildVariant;
+        mutable bool (*magicMatch)(std::ifstream& f) = nullptr;
+        mutable Dlhandle *dlhandle = nullptr;
 
         // The only way an implementation should be constructed
         LLModel *construct() const {
+            if (!load())
+                return nullptr;
             auto fres = construct_();
             fres->m_implementation = this;
             return fres;
         }
+
+    private:
+        Signature m_signature;
+        mutable LLModel *(*construct_)() = nullptr;
     };
 
     struct PromptContext {
         std::vector<float> logits;      // logits of current context
-        std::vector<int32_t> tokens;    // current tokens in the context window
+        std::vector<int32_t> tokens;    // current tokens in the context window; any past n_past are
+            // still in the kv cache and get reused by a following prompt that starts with them
         int32_t n_past = 0;             // number of tokens in past conversation
         int32_t n_ctx = 0;              // number of tokens possible in context window
         int32_t n_predict = 200;
@@ -50,18 +81,62 @@ public:
         int32_t n_batch = 9;
         float   repeat_penalty = 1.10f;
         int32_t repeat_last_n = 64;     // last n tokens to penalize
+        float   presence_penalty = 0.0f;  // subtracted from the logits of the last n tokens
+        float   frequency_penalty = 0.0f; // subtracted again for every time they occur
+        float   min_p = 0.0f;           // drop tokens less likely than min_p times the most likely
+        float   typical_p = 1.0f;       // locally typical sampling, 1.0 = disabled
+        int32_t mirostat = 0;           // non-zero = mirostat 2.0 instead of top k/top p
+        float   mirostat_tau = 5.0f;    // target surprise of mirostat
+        float   mirostat_eta = 0.1f;    // learning rate of mirostat
+        float   mirostat_mu = 10.0f;    // current maximum surprise of mirostat, starts at 2 * tau
+        std::vector<std::pair<int32_t, float>> logitBias; // added to the logits of these tokens
         float   contextErase = 0.75f;   // percent of context to erase if we exceed the context
             // window
+        int32_t n_keep = 0;             // number of leading tokens that survive when the context
+            // window is full and part of it gets erased
+        int32_t seq_id = 0;             // kv cache sequence slot this context is evaluated in
+        std::vector<std::string> stopSequences = { "### Instruction", "### Prompt", "### Response",
+            "### Human", "### Assistant", "### Context" }; // generation stops before any of these
+    };
+
+    // A sequence that is decoded together with others by 'decodeBatch'. Sequences can join (see
+    // 'beginSequence') or leave the batch between any two steps.
+    struct BatchSequence {
+        PromptContext *ctx = nullptr;
+        std::function<bool(int32_t, const std::string&)> responseCallback;
+        int32_t n_predicted = 0;
+        bool finished = false;
+        StopSequenceFilter stops;
+    };
+
+    // How 'loadModel' sets up the model; implementations ignore what they don't support
+    struct LoadOptions {
+        // Precision of the keys in the kv cache; the values stay F16. The quantized keys take about a
+        // half and a quarter of the memory of F16 ones, which makes the whole kv cache about three
+        // quarters and two thirds of its F16 size. Implementations fall back to F16 where the model's
+        // attention heads can't be quantized like that
+        enum class KVType { F16, Q8_0, Q4_0 };
+        KVType kvType = KVType::F16;
+        // Number of tokens in the context window, 0 for the size the model was trained with. Models
+        // that can't attend further than that are limited to it
+        int32_t n_ctx = 0;
     };
 
     explicit LLModel() {}
     virtual ~LLModel() {}
 
+    // The options take effect with the next call to 'loadModel'; sessions get those of their model
+    void setLoadOptions(const LoadOptions &options) { m_loadOptions = options; }
+    const LoadOptions &loadOptions() const { return m_loadOptions; }
     virtual bool loadModel(const std::string &modelPath) = 0;
     virtual bool isModelLoaded() const = 0;
     virtual size_t stateSize() const { return 0; }
     virtual size_t saveState(uint8_t */*dest*/) const { return 0; }
     virtual size_t restoreState(const uint8_t */*src*/) { return 0; }
+    // Incremental state: only the kv cache entries from the n_from-th token of each sequence on, to be
+    // restored after a state that already holds the ones before them; 0 if the model can't do that
+    virtual size_t stateSizeFrom(int32_t n_from) const { return n_from ? 0 : stateSize(); }
+    virtual size_t saveStateFrom(uint8_t *dest, int32_t n_from) const { return n_from ? 0 : saveState(dest); }
     virtual void prompt(const std::string &prompt,
                         std::function<bool(int32_t)> promptCallback,
                         std::function<bool(int32_t, const std::string&)> responseCallback,
@@ -71,6 +146,57 @@ public:
     virtual void setThreadCount(int32_t /*n_threads*/) {}
     virtual int32_t threadCount() const { return 1; }
 
+    // Number of independent sequences the kv cache can hold; every PromptContext must use a distinct
+    // 'seq_id' below this count. Changing it discards the contents of the kv cache.
+    virtual bool setSequenceCount(int32_t n_seq) { return n_seq == 1; }
+    virtual int32_t sequenceCount() const { return 1; }
+    // Memory the kv cache takes for each of the sequences it can hold once they fill the context window
+    virtual size_t sequenceMemorySize() const { return 0; }
+
+    // State of a single sequence of the kv cache, optionally only from its n_from-th token on like with
+    // saveStateFrom; restoreSequenceState puts it into the slot 'seq_id', which needn't be the one it was
+    // saved from. 0 if the model can't do that
+    virtual size_t sequenceStateSize(int32_t seq_id, int32_t n_from) const {
+        return seq_id == 0 && sequenceCount() == 1 ? stateSizeFrom(n_from) : 0;
+    }
+    virtual size_t saveSequenceState(int32_t seq_id, uint8_t *dest, int32_t n_from) const {
+        return seq_id == 0 && sequenceCount() == 1 ? saveStateFrom(dest, n_from) : 0;
+    }
+    virtual size_t restoreSequenceState(int32_t seq_id, const uint8_t *src) {
+        return seq_id == 0 && sequenceCount() == 1 ? restoreState(src) : 0;
+    }
+    // Lets sequence 'dst' continue from the first 'n_tokens' tokens of sequence 'src', e.g. to sample
+    // several answers to one prompt. Implementations with a paged kv cache share those entries until
+    // either sequence overwrites them, so that costs no copy. False if the model can't do that
+    virtual bool forkSequence(int32_t /*src*/, int32_t /*dst*/, int32_t /*n_tokens*/) { return false; }
+
+    // Creates another instance of this model that uses the same weights but has a kv cache, random number
+    // generator and buffers of its own, so that it can be used from another thread at the same time. The
+    // weights stay loaded until the last instance using them is deleted. Returns nullptr if the model
+    // isn't loaded or the implementation can't share its weights
+    virtual LLModel *newSession() const { return nullptr; }
+
+    // Continuous batching: 'beginSequence' processes the prompt of a new sequence into its kv cache
+    // slot and 'decodeBatch' then samples and evaluates one new token for every sequence that has not
+    // finished yet in a single evaluation. Returns the number of sequences that are still running.
+    bool beginSequence(BatchSequence &seq, const std::string &prompt,
+                       std::function<bool(int32_t)> promptCallback);
+    size_t decodeBatch(const std::vector<BatchSequence*> &seqs);
+    // Starts 'seq' in the kv cache slot of its context as a copy of 'from', e.g. right after its prompt,
+    // with the sampling parameters of 'from' and without evaluating anything (see 'forkSequence')
+    bool beginSequenceFrom(BatchSequence &seq, const BatchSequence &from);
+
+    // Speculative decoding: 'draft' is a smaller model sharing this model's vocabulary that proposes up
+    // to 'n_draft' tokens ahead, which are then verified with a single evaluation of this model. The
+    // draft model is not owned and must not be used for anything else meanwhile; nullptr disables it
+    void setDraftModel(LLModel *draft, int32_t n_draft = 4);
+    LLModel *draftModel() const { return m_draftModel; }
+
+    // Prompt lookup decoding: without a draft model, up to 'n_draft' tokens are proposed by finding the
+    // last 'n_gram' tokens earlier in the context and copying what followed them there. Useful when the
+    // answer quotes its prompt, e.g. for summaries or code edits. An 'n_draft' of 0 disables it
+    void setPromptLookup(int32_t n_draft, int32_t n_gram = 3);
+
     const Implementation& implementation() const {
         return *m_implementation;
     }
@@ -89,13 +215,38 @@ protected:
     virtual std::string tokenToString(Token) const = 0;
     virtual Token sampleToken(PromptContext &ctx) const = 0;
     virtual bool evalTokens(PromptContext &/*ctx*/, const std::vector<int32_t>& /*tokens*/) const = 0;
+    // Evaluates exactly one token for each of the contexts. The default implementation evaluates
+    // them one after the other; backends override it to evaluate all of them in one graph
+    virtual bool evalBatch(const std::vector<PromptContext*> &ctxs, const std::vector<Token> &tokens) const;
+    // Like 'evalTokens' but stores the logits of every token, one row of n_vocab after the other, in
+    // 'logits' and leaves the context untouched. The default implementation evaluates the tokens one by one
+    virtual bool evalTokensAll(PromptContext &ctx, const std::vector<int32_t> &tokens, std::vector<float> &logits) const;
     virtual int32_t contextLength() const = 0;
     virtual const std::vector<Token>& endTokens() const = 0;
+    bool isEndToken(Token id) const;
+
+    // Removes 'n_discard' tokens following the first 'n_keep' from the kv cache of the context by moving
+    // the entries behind them forward, which is much cheaper than recalculating the context. Returns
+    // false if the implementation can't do this in which case the context is recalculated instead
+    virtual bool shiftContext(PromptContext &/*ctx*/, int32_t /*n_keep*/, int32_t /*n_discard*/) { return false; }
 
     // This is a helper function called from the default implementation of 'prompt' but it can be
     // shared by all base classes so it isn't virtual
     void recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate);
+    void eraseContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate);
+    bool evalPrompt(const std::vector<Token> &embd_inp, PromptContext &promptCtx,
+                    std::function<bool(int32_t)> promptCallback,
+                    std::function<bool(bool)> recalculateCallback);
+    bool speculate(PromptContext &promptCtx, int32_t n_remaining, Token &next, std::vector<Token> &accepted);
+    void draftTokens(const std::vector<Token> &history, int32_t n_draft, int32_t n_vocab, std::vector<Token> &batch);
+    void lookupTokens(const std::vector<Token> &history, int32_t n_draft, std::vector<Token> &batch) const;
 
     const Implementation *m_implementation = nullptr;
+    LoadOptions m_loadOptions;
+    LLModel *m_draftModel = nullptr;
+    int32_t m_nDraft = 0;
+    PromptContext m_draftCtx;
+    int32_t m_nLookup = 0;
+    int32_t m_lookupNgram = 3;
 };
 #endif // LLMODEL_H
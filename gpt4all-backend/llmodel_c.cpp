@@ -12,6 +12,11 @@ struct LLModelWrapper {
     ~LLModelWrapper() { delete llModel; }
 };
 
+struct LLModelSequenceWrapper {
+    LLModel::PromptContext promptContext;
+    LLModel::BatchSequence seq;
+};
+
 
 thread_local static std::string last_error_message;
 
@@ -60,6 +65,37 @@ void llmodel_model_destroy(llmodel_model model) {
     delete reinterpret_cast<LLModelWrapper*>(model);
 }
 
+llmodel_model llmodel_session_create(llmodel_model model) {
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModel *session = wrapper->llModel->newSession();
+    if (!session)
+        return nullptr;
+    // a session is used through the same kind of handle as a model, so it works with all of its functions
+    auto sessionWrapper = new LLModelWrapper;
+    sessionWrapper->llModel = session;
+    return sessionWrapper;
+}
+
+void llmodel_setKVType(llmodel_model model, int32_t kv_type)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    auto options = wrapper->llModel->loadOptions();
+    switch (kv_type) {
+    case LLMODEL_KV_Q8_0: options.kvType = LLModel::LoadOptions::KVType::Q8_0; break;
+    case LLMODEL_KV_Q4_0: options.kvType = LLModel::LoadOptions::KVType::Q4_0; break;
+    default:              options.kvType = LLModel::LoadOptions::KVType::F16;  break;
+    }
+    wrapper->llModel->setLoadOptions(options);
+}
+
+void llmodel_setContextLength(llmodel_model model, int32_t n_ctx)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    auto options = wrapper->llModel->loadOptions();
+    options.n_ctx = n_ctx > 0 ? n_ctx : 0;
+    wrapper->llModel->setLoadOptions(options);
+}
+
 bool llmodel_loadModel(llmodel_model model, const char *model_path)
 {
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
@@ -90,6 +126,18 @@ uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src)
     return wrapper->llModel->restoreState(src);
 }
 
+uint64_t llmodel_get_state_size_from(llmodel_model model, int32_t n_from)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->stateSizeFrom(n_from);
+}
+
+uint64_t llmodel_save_state_data_from(llmodel_model model, uint8_t *dest, int32_t n_from)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->saveStateFrom(dest, n_from);
+}
+
 // Wrapper functions for the C callbacks
 bool prompt_wrapper(int32_t token_id, void *user_data) {
     llmodel_prompt_callback callback = reinterpret_cast<llmodel_prompt_callback>(user_data);
@@ -157,6 +205,12 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
     ctx->context_erase = wrapper->promptContext.contextErase;
 }
 
+void llmodel_set_stop_sequences(llmodel_model model, const char **stop_sequences, size_t n_stop_sequences)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    wrapper->promptContext.stopSequences.assign(stop_sequences, stop_sequences + n_stop_sequences);
+}
+
 void llmodel_setThreadCount(llmodel_model model, int32_t n_threads)
 {
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
@@ -169,6 +223,98 @@ int32_t llmodel_threadCount(llmodel_model model)
     return wrapper->llModel->threadCount();
 }
 
+bool llmodel_set_sequence_count(llmodel_model model, int32_t n_seq)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->setSequenceCount(n_seq);
+}
+
+int32_t llmodel_sequence_count(llmodel_model model)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->sequenceCount();
+}
+
+llmodel_sequence llmodel_sequence_begin(llmodel_model model, int32_t seq_id, const char *prompt,
+                                        llmodel_prompt_callback prompt_callback,
+                                        llmodel_response_callback response_callback,
+                                        const llmodel_prompt_context *ctx)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    auto seqWrapper = new LLModelSequenceWrapper;
+
+    std::function<bool(int32_t)> prompt_func =
+        std::bind(&prompt_wrapper, std::placeholders::_1, reinterpret_cast<void*>(prompt_callback));
+    seqWrapper->seq.responseCallback =
+        std::bind(&response_wrapper, std::placeholders::_1, std::placeholders::_2, reinterpret_cast<void*>(response_callback));
+    seqWrapper->seq.ctx = &seqWrapper->promptContext;
+
+    // Copy the C prompt context; every sequence starts from an empty kv cache slot
+    seqWrapper->promptContext.seq_id = seq_id;
+    seqWrapper->promptContext.n_ctx = ctx->n_ctx;
+    seqWrapper->promptContext.n_predict = ctx->n_predict;
+    seqWrapper->promptContext.top_k = ctx->top_k;
+    seqWrapper->promptContext.top_p = ctx->top_p;
+    seqWrapper->promptContext.temp = ctx->temp;
+    seqWrapper->promptContext.n_batch = ctx->n_batch;
+    seqWrapper->promptContext.repeat_penalty = ctx->repeat_penalty;
+    seqWrapper->promptContext.repeat_last_n = ctx->repeat_last_n;
+    seqWrapper->promptContext.contextErase = ctx->context_erase;
+    seqWrapper->promptContext.stopSequences = wrapper->promptContext.stopSequences;
+
+    if (!wrapper->llModel->beginSequence(seqWrapper->seq, prompt, prompt_func)) {
+        delete seqWrapper;
+        return nullptr;
+    }
+    return reinterpret_cast<llmodel_sequence>(seqWrapper);
+}
+
+llmodel_sequence llmodel_sequence_fork(llmodel_model model, int32_t seq_id, llmodel_sequence from,
+                                       llmodel_response_callback response_callback)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    auto fromWrapper = reinterpret_cast<LLModelSequenceWrapper*>(from);
+    auto seqWrapper = new LLModelSequenceWrapper;
+
+    seqWrapper->seq.responseCallback =
+        std::bind(&response_wrapper, std::placeholders::_1, std::placeholders::_2, reinterpret_cast<void*>(response_callback));
+    seqWrapper->seq.ctx = &seqWrapper->promptContext;
+    seqWrapper->promptContext.seq_id = seq_id;
+
+    if (!wrapper->llModel->beginSequenceFrom(seqWrapper->seq, fromWrapper->seq)) {
+        delete seqWrapper;
+        return nullptr;
+    }
+    return reinterpret_cast<llmodel_sequence>(seqWrapper);
+}
+
+size_t llmodel_decode_batch(llmodel_model model, llmodel_sequence *seqs, size_t n_seqs)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    std::vector<LLModel::BatchSequence*> batch;
+    batch.reserve(n_seqs);
+    for (size_t i = 0; i < n_seqs; ++i)
+        batch.push_back(&reinterpret_cast<LLModelSequenceWrapper*>(seqs[i])->seq);
+    return wrapper->llModel->decodeBatch(batch);
+}
+
+bool llmodel_sequence_finished(llmodel_sequence seq)
+{
+    return reinterpret_cast<LLModelSequenceWrapper*>(seq)->seq.finished;
+}
+
+void llmodel_sequence_free(llmodel_sequence seq)
+{
+    delete reinterpret_cast<LLModelSequenceWrapper*>(seq);
+}
+
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModelWrapper *draftWrapper = reinterpret_cast<LLModelWrapper*>(draft);
+    wrapper->llModel->setDraftModel(draftWrapper ? draftWrapper->llModel : nullptr, n_draft);
+}
+
 void llmodel_set_implementation_search_path(const char *path)
 {
     LLModel::setImplementationsSearchPath(path);
@@ -23,6 +23,11 @@ extern "C" {
  */
 typedef void *llmodel_model;
 
+/**
+ * Opaque pointer to a sequence that is decoded in a batch with others.
+ */
+typedef void *llmodel_sequence;
+
 /**
  * Structure containing any errors that may eventually occur
  */
@@ -107,6 +112,45 @@ llmodel_model llmodel_model_create2(const char *model_path, const char *build_va
  */
 void llmodel_model_destroy(llmodel_model model);
 
+/**
+ * Create a session of a loaded model.
+ * The session uses the weights of the model but has its own context, so it can generate in another
+ * thread at the same time. Destroy it with llmodel_model_destroy; the weights stay around until the
+ * model and all of its sessions are destroyed.
+ * @param model A pointer to the llmodel_model instance.
+ * @return A pointer to the new llmodel_model instance; NULL if the model is not loaded or its
+ * implementation doesn't support sessions.
+ */
+llmodel_model llmodel_session_create(llmodel_model model);
+
+/**
+ * Precision of the keys in the kv cache, see llmodel_setKVType.
+ */
+enum llmodel_kv_type {
+    LLMODEL_KV_F16 = 0,
+    LLMODEL_KV_Q8_0 = 1,
+    LLMODEL_KV_Q4_0 = 2,
+};
+
+/**
+ * Set the precision of the keys in the kv cache for the next call to llmodel_loadModel; the values
+ * stay F16. Quantized keys take about a half and a quarter of the memory of F16 ones, so the whole
+ * kv cache about three quarters and two thirds of its F16 size. Implementations that can't quantize
+ * the keys of a model use F16.
+ * @param model A pointer to the llmodel_model instance.
+ * @param kv_type One of the llmodel_kv_type values.
+ */
+void llmodel_setKVType(llmodel_model model, int32_t kv_type);
+
+/**
+ * Set the number of tokens in the context window for the next call to llmodel_loadModel.
+ * The kv cache only takes the memory of the tokens a context actually holds. Models that can't
+ * attend further than the context size they were trained with are limited to it.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_ctx The number of tokens, 0 for the size the model was trained with.
+ */
+void llmodel_setContextLength(llmodel_model model, int32_t n_ctx);
+
 /**
  * Load a model from a file.
  * @param model A pointer to the llmodel_model instance.
@@ -148,6 +192,24 @@ uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest);
  */
 uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src);
 
+/**
+ * Get the size of an incremental state of the model.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_from The number of tokens of each sequence held by the state it follows.
+ * @return the size in bytes of the state; 0 if the model doesn't support incremental states
+ */
+uint64_t llmodel_get_state_size_from(llmodel_model model, int32_t n_from);
+
+/**
+ * Saves the part of the internal state of the model that was added after the first n_from tokens.
+ * Restore it with llmodel_restore_state_data after the state it follows.
+ * @param model A pointer to the llmodel_model instance.
+ * @param dest A pointer to the destination.
+ * @param n_from The number of tokens of each sequence held by the state it follows.
+ * @return the number of bytes copied
+ */
+uint64_t llmodel_save_state_data_from(llmodel_model model, uint8_t *dest, int32_t n_from);
+
 /**
  * Generate a response using the model.
  * @param model A pointer to the llmodel_model instance.
@@ -163,6 +225,15 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
                     llmodel_recalculate_callback recalculate_callback,
                     llmodel_prompt_context *ctx);
 
+/**
+ * Set the strings that end a response; the response is cut off right before the first one it contains.
+ * These replace the default stop sequences and are used by all following prompts and sequences.
+ * @param model A pointer to the llmodel_model instance.
+ * @param stop_sequences An array of strings.
+ * @param n_stop_sequences The number of strings in the array.
+ */
+void llmodel_set_stop_sequences(llmodel_model model, const char **stop_sequences, size_t n_stop_sequences);
+
 /**
  * Set the number of threads to be used by the model.
  * @param model A pointer to the llmodel_model instance.
@@ -177,6 +248,82 @@ void llmodel_setThreadCount(llmodel_model model, int32_t n_threads);
  */
 int32_t llmodel_threadCount(llmodel_model model);
 
+/**
+ * Set the number of independent sequences the model's kv cache can hold for batched decoding.
+ * NOTE: This discards the contents of the kv cache. Only some implementations support more than one.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_seq The number of sequences.
+ * @return true if the number of sequences was changed successfully, false otherwise.
+ */
+bool llmodel_set_sequence_count(llmodel_model model, int32_t n_seq);
+
+/**
+ * Get the number of independent sequences the model's kv cache can hold.
+ * @param model A pointer to the llmodel_model instance.
+ * @return The number of sequences.
+ */
+int32_t llmodel_sequence_count(llmodel_model model);
+
+/**
+ * Start a new sequence in the given kv cache slot and process its prompt.
+ * @param model A pointer to the llmodel_model instance.
+ * @param seq_id The kv cache slot of the sequence; must be below llmodel_sequence_count().
+ * @param prompt A string representing the input prompt.
+ * @param prompt_callback A callback function for handling the processing of prompt.
+ * @param response_callback A callback function for handling the generated response.
+ * @param ctx A pointer to the llmodel_prompt_context structure holding the sampling parameters.
+ * @return A pointer to the llmodel_sequence instance; NULL on error.
+ */
+llmodel_sequence llmodel_sequence_begin(llmodel_model model, int32_t seq_id, const char *prompt,
+                                        llmodel_prompt_callback prompt_callback,
+                                        llmodel_response_callback response_callback,
+                                        const llmodel_prompt_context *ctx);
+
+/**
+ * Start a new sequence in the given kv cache slot as a copy of another one, e.g. right after its
+ * prompt to generate several responses to it. The kv cache entries of its tokens are shared rather
+ * than evaluated again where the model supports that.
+ * @param model A pointer to the llmodel_model instance.
+ * @param seq_id The kv cache slot of the new sequence; must be below llmodel_sequence_count().
+ * @param from A pointer to the llmodel_sequence instance to copy.
+ * @param response_callback A callback function for handling the generated response.
+ * @return A pointer to the llmodel_sequence instance; NULL on error.
+ */
+llmodel_sequence llmodel_sequence_fork(llmodel_model model, int32_t seq_id, llmodel_sequence from,
+                                       llmodel_response_callback response_callback);
+
+/**
+ * Generate one token for each of the given sequences that has not finished yet, evaluating all of
+ * them at once. Sequences can be started or freed between any two calls.
+ * @param model A pointer to the llmodel_model instance.
+ * @param seqs An array of sequences started on this model.
+ * @param n_seqs The number of sequences in the array.
+ * @return The number of sequences that are still running.
+ */
+size_t llmodel_decode_batch(llmodel_model model, llmodel_sequence *seqs, size_t n_seqs);
+
+/**
+ * Check if a sequence has finished generating.
+ * @param seq A pointer to the llmodel_sequence instance.
+ * @return true if the sequence has finished, false otherwise.
+ */
+bool llmodel_sequence_finished(llmodel_sequence seq);
+
+/**
+ * Destroy a sequence; its kv cache slot may then be reused by a new one.
+ * @param seq A pointer to the llmodel_sequence instance.
+ */
+void llmodel_sequence_free(llmodel_sequence seq);
+
+/**
+ * Enable speculative decoding with a smaller draft model that shares the vocabulary of the model.
+ * NOTE: The draft model must stay alive and must not be used for anything else while it is set.
+ * @param model A pointer to the llmodel_model instance.
+ * @param draft A pointer to the llmodel_model instance of the draft model; NULL disables speculation.
+ * @param n_draft The maximum number of tokens the draft model proposes at once.
+ */
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft);
+
 /**
  * Set llmodel implementation search path.
  * Default is "."
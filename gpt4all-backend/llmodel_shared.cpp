@@ -1,8 +1,8 @@
 #include "llmodel.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
-#include <unordered_set>
 
 void LLModel::recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate) {
     size_t i = 0;
@@ -26,6 +26,73 @@ stop_generating:
     recalculate(false);
 }
 
+void LLModel::eraseContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate) {
+    // Erase a percentage of the context following the first n_keep tokens...
+    std::cerr << implementation().modelType << ": reached the end of the context window so resizing\n";
+    const int32_t n_tokens = promptCtx.tokens.size();
+    const int32_t n_discard = std::min(int32_t(promptCtx.n_ctx * promptCtx.contextErase), n_tokens);
+    const int32_t n_keep = std::max(0, std::min(promptCtx.n_keep, n_tokens - n_discard));
+
+    // The kv cache can only be shifted in place when it holds exactly the tokens of the context
+    const bool shifted = n_tokens == promptCtx.n_past && shiftContext(promptCtx, n_keep, n_discard);
+
+    promptCtx.tokens.erase(promptCtx.tokens.begin() + n_keep, promptCtx.tokens.begin() + n_keep + n_discard);
+    promptCtx.n_past = promptCtx.tokens.size();
+    if (!shifted)
+        recalculateContext(promptCtx, recalculate);
+}
+
+bool LLModel::evalPrompt(const std::vector<Token> &embd_inp, PromptContext &promptCtx,
+                         std::function<bool(int32_t)> promptCallback,
+                         std::function<bool(bool)> recalculateCallback)
+{
+    size_t i = 0;
+
+    // Tokens past n_past are still in the kv cache from an earlier evaluation, e.g. when the caller
+    // rewound n_past to start over. Skip the leading part of the input that matches them; at least one
+    // token is always evaluated so that the logits belong to the end of the new input
+    if (int32_t(promptCtx.tokens.size()) > promptCtx.n_past && promptCtx.n_past >= 0) {
+        const size_t n_resident = promptCtx.tokens.size() - promptCtx.n_past;
+        const size_t n_max = std::min(n_resident, embd_inp.empty() ? 0 : embd_inp.size() - 1);
+        while (i < n_max && promptCtx.tokens[promptCtx.n_past + i] == embd_inp[i])
+            ++i;
+        promptCtx.tokens.resize(promptCtx.n_past + i);
+        promptCtx.n_past += i;
+        for (size_t t = 0; t < i; ++t) {
+            if (!promptCallback(embd_inp[t]))
+                return false;
+        }
+    }
+
+    while (i < embd_inp.size()) {
+        size_t batch_end = std::min(i + promptCtx.n_batch, embd_inp.size());
+        std::vector<Token> batch(embd_inp.begin() + i, embd_inp.begin() + batch_end);
+
+        // Check if the context has run out...
+        if (promptCtx.n_past + int32_t(batch.size()) > promptCtx.n_ctx) {
+            eraseContext(promptCtx, recalculateCallback);
+            assert(promptCtx.n_past + int32_t(batch.size()) <= promptCtx.n_ctx);
+        }
+
+        if (!evalTokens(promptCtx, batch)) {
+            std::cerr << implementation().modelType << " ERROR: Failed to process prompt\n";
+            return false;
+        }
+
+        size_t tokens = batch_end - i;
+        for (size_t t = 0; t < tokens; ++t) {
+            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
+                promptCtx.tokens.erase(promptCtx.tokens.begin());
+            promptCtx.tokens.push_back(batch.at(t));
+            if (!promptCallback(batch.at(t)))
+                return false;
+        }
+        promptCtx.n_past += batch.size();
+        i = batch_end;
+    }
+    return true;
+}
+
 void LLModel::prompt(const std::string &prompt,
                      std::function<bool(int32_t)> promptCallback,
                      std::function<bool(int32_t, const std::string&)> responseCallback,
@@ -54,106 +121,347 @@ void LLModel::prompt(const std::string &prompt,
     promptCtx.n_past = std::min(promptCtx.n_past, promptCtx.n_ctx);
 
     // process the prompt in batches
-    size_t i = 0;
-    while (i < embd_inp.size()) {
-        size_t batch_end = std::min(i + promptCtx.n_batch, embd_inp.size());
-        std::vector<Token> batch(embd_inp.begin() + i, embd_inp.begin() + batch_end);
+    if (!evalPrompt(embd_inp, promptCtx, promptCallback, recalculateCallback))
+        return;
 
-        // Check if the context has run out...
-        if (promptCtx.n_past + int32_t(batch.size()) > promptCtx.n_ctx) {
-            const int32_t erasePoint = promptCtx.n_ctx * promptCtx.contextErase;
-            // Erase the first percentage of context from the tokens...
-            std::cerr << implementation().modelType << ": reached the end of the context window so resizing\n";
-            promptCtx.tokens.erase(promptCtx.tokens.begin(), promptCtx.tokens.begin() + erasePoint);
-            promptCtx.n_past = promptCtx.tokens.size();
-            recalculateContext(promptCtx, recalculateCallback);
-            assert(promptCtx.n_past + int32_t(batch.size()) <= promptCtx.n_ctx);
-        }
+    // predict next tokens
+    StopSequenceFilter stops(promptCtx.stopSequences);
+    std::vector<Token> newTokens;
+    std::vector<StopSequenceFilter::Piece> response;
+    Token next = -1; // already sampled from the logits of the context but not evaluated yet
+    for (int i = 0; i < promptCtx.n_predict;) {
 
-        if (!evalTokens(promptCtx, batch)) {
-            std::cerr << implementation().modelType << " ERROR: Failed to process prompt\n";
-            return;
+        // try to decode several tokens at once if speculation is enabled
+        newTokens.clear();
+        const bool speculative = m_draftModel || m_nLookup > 0;
+        if (!speculative || !speculate(promptCtx, promptCtx.n_predict - i, next, newTokens)) {
+            // sample next token unless speculation already did
+            auto id = next >= 0 ? next : sampleToken(promptCtx);
+            next = -1;
+
+            // Check if the context has run out...
+            if (promptCtx.n_past + 1 > promptCtx.n_ctx) {
+                eraseContext(promptCtx, recalculateCallback);
+                assert(promptCtx.n_past + 1 <= promptCtx.n_ctx);
+            }
+
+            if (!evalTokens(promptCtx, { id })) {
+                std::cerr << implementation().modelType << " ERROR: Failed to predict next token\n";
+                return;
+            }
+
+            promptCtx.n_past += 1;
+            newTokens.push_back(id);
         }
 
-        size_t tokens = batch_end - i;
-        for (size_t t = 0; t < tokens; ++t) {
+        // the tokens are in the kv cache now whether or not they end up in the response
+        bool stopped = false;
+        for (const Token id : newTokens) {
             if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
                 promptCtx.tokens.erase(promptCtx.tokens.begin());
-            promptCtx.tokens.push_back(batch.at(t));
-            if (!promptCallback(batch.at(t)))
+            promptCtx.tokens.push_back(id);
+            ++i;
+            if (!stopped)
+                stopped = isEndToken(id) || stops.push(id, tokenToString(id));
+        }
+
+        // pass on the text that can't be part of a stop sequence anymore, or everything once we are done
+        response.clear();
+        stops.release(response, stopped || i >= promptCtx.n_predict);
+        for (const auto &piece : response) {
+            if (!responseCallback(piece.token, piece.text))
                 return;
         }
-        promptCtx.n_past += batch.size();
-        i = batch_end;
+        if (stopped)
+            return;
     }
+}
 
-    std::string cachedResponse;
-    std::vector<Token> cachedTokens;
-    std::unordered_set<std::string> reversePrompts
-        = { "### Instruction", "### Prompt", "### Response", "### Human", "### Assistant", "### Context" };
+void LLModel::setDraftModel(LLModel *draft, int32_t n_draft)
+{
+    m_draftModel = draft;
+    m_nDraft = n_draft;
+    m_draftCtx = PromptContext();
+}
 
-    // predict next tokens
-    for (int i = 0; i < promptCtx.n_predict; i++) {
+bool LLModel::evalTokensAll(PromptContext &ctx, const std::vector<int32_t> &tokens, std::vector<float> &logits) const
+{
+    PromptContext tmpCtx = ctx;
+    logits.clear();
+    for (const int32_t t : tokens) {
+        if (!evalTokens(tmpCtx, { t }))
+            return false;
+        logits.insert(logits.end(), tmpCtx.logits.begin(), tmpCtx.logits.end());
+        tmpCtx.n_past += 1;
+    }
+    return true;
+}
 
-        // sample next token
-        auto id = sampleToken(promptCtx);
+void LLModel::setPromptLookup(int32_t n_draft, int32_t n_gram)
+{
+    m_nLookup = n_draft;
+    m_lookupNgram = std::max(1, n_gram);
+}
 
-        // Check if the context has run out...
-        if (promptCtx.n_past + 1 > promptCtx.n_ctx) {
-            const int32_t erasePoint = promptCtx.n_ctx * promptCtx.contextErase;
-            // Erase the first percentage of context from the tokens...
-            std::cerr << implementation().modelType << ": reached the end of the context window so resizing\n";
-            promptCtx.tokens.erase(promptCtx.tokens.begin(), promptCtx.tokens.begin() + erasePoint);
-            promptCtx.n_past = promptCtx.tokens.size();
-            recalculateContext(promptCtx, recalculateCallback);
-            assert(promptCtx.n_past + 1 <= promptCtx.n_ctx);
+// One step of speculative decoding: sample the next token as usual, or take 'next' if that is already
+// sampled, guess the tokens that follow it with the draft model or by prompt lookup and evaluate all of
+// them at once. Every guess is then checked by sampling from our own logits at its position; guesses are
+// accepted for as long as the sample agrees. The first sample that doesn't is the token after them and
+// becomes 'next', so no logits are ever sampled twice and the tokens come out exactly like sampling them
+// one at a time with the same random numbers. All accepted tokens are evaluated and the logits of the
+// context belong to the last of them. Returns false without evaluating anything if speculation isn't
+// possible for this step; 'next' may have been sampled then.
+bool LLModel::speculate(PromptContext &promptCtx, int32_t n_remaining, Token &next, std::vector<Token> &accepted)
+{
+    const int32_t n_draft = std::min(m_draftModel ? m_nDraft : m_nLookup, n_remaining - 1);
+    if (n_draft < 1 || promptCtx.n_past + n_draft + 1 > promptCtx.n_ctx)
+        return false;
+
+    // the guesses have to continue exactly the tokens that are in our kv cache
+    if (int32_t(promptCtx.tokens.size()) != promptCtx.n_past)
+        return false;
+    if (m_draftModel && promptCtx.n_past + n_draft + 1 > m_draftModel->contextLength())
+        return false;
+
+    if (next < 0)
+        next = sampleToken(promptCtx);
+    std::vector<Token> batch = { next };
+
+    std::vector<Token> history = promptCtx.tokens;
+    history.push_back(batch.front());
+    if (m_draftModel)
+        draftTokens(history, n_draft, promptCtx.logits.size(), batch);
+    else
+        lookupTokens(history, n_draft, batch);
+
+    std::vector<float> logits;
+    if (!evalTokensAll(promptCtx, batch, logits)) {
+        std::cerr << implementation().modelType << " ERROR: Failed to verify draft tokens\n";
+        return false;
+    }
+
+    // the repeat penalty has to see the accepted tokens just like when sampling them one at a time
+    const size_t n_vocab = promptCtx.logits.size();
+    const size_t n_tokens = promptCtx.tokens.size();
+    accepted = { batch.front() };
+    next = -1;
+    for (size_t j = 1; j < batch.size() && !isEndToken(accepted.back()); ++j) {
+        promptCtx.logits.assign(logits.begin() + (j - 1) * n_vocab, logits.begin() + j * n_vocab);
+        promptCtx.tokens.push_back(batch[j - 1]);
+        const Token id = sampleToken(promptCtx);
+        if (id != batch[j]) {
+            next = id;
+            break;
         }
+        accepted.push_back(batch[j]);
+    }
+    promptCtx.tokens.resize(n_tokens);
 
-        if (!evalTokens(promptCtx, { id })) {
-            std::cerr << implementation().modelType << " ERROR: Failed to predict next token\n";
+    promptCtx.logits.assign(logits.begin() + (accepted.size() - 1) * n_vocab,
+                            logits.begin() + accepted.size() * n_vocab);
+    promptCtx.n_past += accepted.size();
+    return true;
+}
+
+// Appends the most likely continuation of 'history' according to the draft model to 'batch'
+void LLModel::draftTokens(const std::vector<Token> &history, int32_t n_draft, int32_t n_vocab,
+                          std::vector<Token> &batch)
+{
+    // catch the draft model up with everything we have seen, reusing what its kv cache still holds
+    m_draftCtx.n_ctx = m_draftModel->contextLength();
+    m_draftCtx.n_past = 0;
+    if (!m_draftModel->evalPrompt(history, m_draftCtx, [](int32_t) { return true; }, [](bool) { return true; }))
+        return;
+    if (int32_t(m_draftCtx.logits.size()) != n_vocab)
+        return;
+
+    const size_t n_batch = batch.size() + n_draft;
+    while (batch.size() < n_batch && !isEndToken(batch.back())) {
+        if (batch.size() > 1) {
+            if (!m_draftModel->evalTokens(m_draftCtx, { batch.back() }))
+                return;
+            m_draftCtx.tokens.push_back(batch.back());
+            m_draftCtx.n_past += 1;
+        }
+        const auto best = std::max_element(m_draftCtx.logits.begin(), m_draftCtx.logits.end());
+        batch.push_back(Token(best - m_draftCtx.logits.begin()));
+    }
+}
+
+// Appends what followed the most recent earlier occurrence of the last few tokens of 'history' to
+// 'batch', trying shorter n-grams if the longest doesn't occur. The context is at most n_ctx tokens so
+// a backwards scan is cheaper than keeping an index up to date
+void LLModel::lookupTokens(const std::vector<Token> &history, int32_t n_draft, std::vector<Token> &batch) const
+{
+    const int32_t n_history = history.size();
+    for (int32_t n = std::min(m_lookupNgram, n_history - 1); n >= 1; --n) {
+        const auto ngram = history.end() - n;
+        for (int32_t i = n_history - n - 1; i >= 0; --i) {
+            if (!std::equal(ngram, history.end(), history.begin() + i))
+                continue;
+            const int32_t first = i + n;
+            const int32_t last = std::min(first + n_draft, n_history);
+            batch.insert(batch.end(), history.begin() + first, history.begin() + last);
             return;
         }
+    }
+}
 
-        promptCtx.n_past += 1;
+bool LLModel::evalBatch(const std::vector<PromptContext*> &ctxs, const std::vector<Token> &tokens) const
+{
+    assert(ctxs.size() == tokens.size());
+    for (size_t i = 0; i < ctxs.size(); ++i) {
+        if (!evalTokens(*ctxs[i], { tokens[i] }))
+            return false;
+    }
+    return true;
+}
 
-        // display text
-        for (const auto token : endTokens()) {
-            if (id == token) return;
-        }
+bool LLModel::beginSequence(BatchSequence &seq, const std::string &prompt,
+                            std::function<bool(int32_t)> promptCallback)
+{
+    if (!isModelLoaded()) {
+        std::cerr << implementation().modelType << " ERROR: prompt won't work with an unloaded model!\n";
+        return false;
+    }
 
-        const std::string str = tokenToString(id);
+    PromptContext &promptCtx = *seq.ctx;
+    if (promptCtx.seq_id < 0 || promptCtx.seq_id >= sequenceCount()) {
+        std::cerr << implementation().modelType << " ERROR: sequence " << promptCtx.seq_id
+            << " is out of range for a kv cache with " << sequenceCount() << " sequences\n";
+        return false;
+    }
 
-        // Check if the provided str is part of our reverse prompts
-        bool foundPartialReversePrompt = false;
-        const std::string completed = cachedResponse + std::string(str);
-        if (reversePrompts.find(completed) != reversePrompts.end())
-            return;
+    std::vector<Token> embd_inp = tokenize(promptCtx, prompt);
+    promptCtx.n_ctx = contextLength();
 
-        // Check if it partially matches our reverse prompts and if so, cache
-        for (const auto& s : reversePrompts) {
-            if (s.compare(0, completed.size(), completed) == 0) {
-                foundPartialReversePrompt = true;
-                cachedResponse = completed;
-                break;
-            }
-        }
+    if ((int) embd_inp.size() > promptCtx.n_ctx - 4) {
+        std::cerr << implementation().modelType << " ERROR: The prompt is" << embd_inp.size() <<
+            "tokens and the context window is" << promptCtx.n_ctx << "!\n";
+        return false;
+    }
 
-        // Regardless the token gets added to our cache
-        cachedTokens.push_back(id);
+    promptCtx.n_predict = std::min(promptCtx.n_predict, promptCtx.n_ctx - (int) embd_inp.size());
+    promptCtx.n_past = std::min(promptCtx.n_past, promptCtx.n_ctx);
+    seq.n_predicted = 0;
+    seq.finished = false;
+    seq.stops = StopSequenceFilter(promptCtx.stopSequences);
+
+    if (!evalPrompt(embd_inp, promptCtx, promptCallback, [](bool) { return true; })) {
+        seq.finished = true;
+        return false;
+    }
+    return true;
+}
+
+bool LLModel::beginSequenceFrom(BatchSequence &seq, const BatchSequence &from)
+{
+    PromptContext &promptCtx = *seq.ctx;
+    const PromptContext &fromCtx = *from.ctx;
+    if (promptCtx.seq_id < 0 || promptCtx.seq_id >= sequenceCount() || promptCtx.seq_id == fromCtx.seq_id) {
+        std::cerr << implementation().modelType << " ERROR: sequence " << promptCtx.seq_id
+            << " can't be forked from sequence " << fromCtx.seq_id << "\n";
+        return false;
+    }
+
+    if (!forkSequence(fromCtx.seq_id, promptCtx.seq_id, fromCtx.n_past)) {
+        std::cerr << implementation().modelType << " ERROR: sequences can't be forked\n";
+        return false;
+    }
 
-        // Continue if we have found a partial match
-        if (foundPartialReversePrompt)
+    // the next token is sampled from the logits 'from' has left
+    const int32_t seq_id = promptCtx.seq_id;
+    promptCtx = fromCtx;
+    promptCtx.seq_id = seq_id;
+    seq.n_predicted = from.n_predicted;
+    seq.finished = from.finished;
+    seq.stops = from.stops;
+    return true;
+}
+
+// Passes the response of a batched sequence on as far as it can't be part of a stop sequence anymore,
+// or all of it with 'all'. Returns false if the sequence should stop
+static bool releaseResponse(LLModel::BatchSequence &seq, bool all)
+{
+    std::vector<StopSequenceFilter::Piece> response;
+    seq.stops.release(response, all);
+    for (const auto &piece : response) {
+        if (!seq.responseCallback(piece.token, piece.text))
+            return false;
+    }
+    return true;
+}
+
+size_t LLModel::decodeBatch(const std::vector<BatchSequence*> &seqs)
+{
+    std::vector<BatchSequence*> batch;
+    std::vector<PromptContext*> ctxs;
+    std::vector<Token> tokens;
+    batch.reserve(seqs.size());
+    ctxs.reserve(seqs.size());
+    tokens.reserve(seqs.size());
+
+    for (BatchSequence *seq : seqs) {
+        if (seq->finished)
             continue;
 
-        // Empty the cache
-        for (auto t : cachedTokens) {
-            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
-                promptCtx.tokens.erase(promptCtx.tokens.begin());
-            promptCtx.tokens.push_back(t);
-            //TODO: Conversion to std::string can be avoided here...
-            if (!responseCallback(t, std::string(tokenToString(t))))
-                return;
+        // a sequence in a shared batch can't stall the others with a recalculation so it just stops
+        // when its context window is exhausted
+        PromptContext &promptCtx = *seq->ctx;
+        if (seq->n_predicted >= promptCtx.n_predict || promptCtx.n_past + 1 > promptCtx.n_ctx) {
+            releaseResponse(*seq, true);
+            seq->finished = true;
+            continue;
+        }
+
+        // sample next token from the logits of the previous step
+        const Token id = sampleToken(promptCtx);
+        if (isEndToken(id)) {
+            releaseResponse(*seq, true);
+            seq->finished = true;
+            continue;
         }
-        cachedTokens.clear();
+
+        ++seq->n_predicted;
+        ctxs.push_back(&promptCtx);
+        tokens.push_back(id);
+        batch.push_back(seq);
+    }
+
+    if (ctxs.empty())
+        return 0;
+
+    if (!evalBatch(ctxs, tokens)) {
+        std::cerr << implementation().modelType << " ERROR: Failed to evaluate batch\n";
+        for (BatchSequence *seq : seqs)
+            seq->finished = true;
+        return 0;
+    }
+
+    // only record the tokens once they are in the kv cache so that 'tokens' never runs ahead of it
+    size_t n_running = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        BatchSequence &seq = *batch[i];
+        PromptContext &promptCtx = *ctxs[i];
+        promptCtx.n_past += 1;
+        if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
+            promptCtx.tokens.erase(promptCtx.tokens.begin());
+        promptCtx.tokens.push_back(tokens[i]);
+
+        const bool stopped = seq.stops.push(tokens[i], tokenToString(tokens[i]));
+        if (!releaseResponse(seq, stopped || seq.n_predicted >= promptCtx.n_predict) || stopped)
+            seq.finished = true;
+        else
+            ++n_running;
+    }
+
+    return n_running;
+}
+
+bool LLModel::isEndToken(Token id) const
+{
+    for (const auto token : endTokens()) {
+        if (id == token) return true;
     }
+    return false;
 }
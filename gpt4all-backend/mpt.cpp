@@ -2,6 +2,7 @@
 #include "mpt_impl.h"
 
 #include "utils.h"
+#include "sampler.h"
 
 #include <cassert>
 #include <cmath>
@@ -9,6 +10,7 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
@@ -82,11 +84,21 @@ struct mpt_kv_cache {
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
+    // the ALiBi bias of every position of the context, n_ctx of them for every head
+    struct ggml_tensor * alibi;
+
     struct ggml_context * ctx = NULL;
 
     mpt_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    std::vector<int> n; // number of tokens currently in the cache for each sequence
+    int n_seq = 1; // number of independent sequences the cache holds
+
+    // the rows of each layer are taken by the sequences a page at a time; the keys of a token are a row
+    // of K, and its values are a column of V, which holds a row of all rows for every embedding
+    // dimension, so that the values of consecutive pages are a view of their own
+    gpt_kv_pages pages;
+    int n_rows() const { return pages.n_pages()*GPT_KV_PAGE; }
 
     ~mpt_kv_cache() {
         if (ctx) {
@@ -108,11 +120,28 @@ struct mpt_model {
     std::vector<mpt_layer> layers;
 
     struct mpt_kv_cache kv_self;
+    ggml_type kv_type = GGML_TYPE_F16; // of the keys, the values are always f16
+    int n_ctx_requested = 0;           // context size asked for at loading, 0 for that of the file
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
+    // the model file if the weights are used from it directly, with copies of those misaligned in it
+    gpt_mmap mapping;
+    std::vector<std::unique_ptr<uint8_t[]>> copies;
 
+    // memory for evaluating the graph, planned for the largest batch so far: the context of the graph
+    // with its inputs and logits, and the scratch buffers its intermediate tensors are computed in
     mpt_buffer buf;
+    mpt_buffer scr0;
+    mpt_buffer scr1;
+    int n_batch_planned = 0;
+    int n_threads_planned = 0;
+
+    // the graph of the last decoding step, in the memory above
+    gpt_decode_graph graph;
+
+    // the model owning the weights if they are shared with it
+    std::shared_ptr<mpt_model> weights;
 
     ~mpt_model() {
         if (ctx) {
@@ -124,15 +153,25 @@ struct mpt_model {
 static bool kv_cache_init(
         const struct mpt_hparams & hparams,
              struct mpt_kv_cache & cache,
-                         ggml_type   wtype,
-                               int   n_ctx) {
+                         ggml_type   ktype,
+                               int   n_pages,
+                               int   n_seq) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
-    const int64_t n_mem      = (int64_t)n_layer*n_ctx;
+    const int64_t n_mem      = (int64_t)n_layer*n_pages*GPT_KV_PAGE;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
+        cache.ctx = NULL;
+    }
+
+    cache.buf.resize(gpt_row_size(ktype, n_elements) + n_elements*ggml_type_size(GGML_TYPE_F16)
+                     + size_t(hparams.n_ctx)*hparams.n_head*sizeof(float) + 2_MiB);
+    cache.n_seq = n_seq;
+    cache.n.assign(n_seq, 0);
+    cache.pages.init(n_pages, n_seq);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -146,12 +185,79 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, GGML_TYPE_F16, n_elements);
+
+    // the sequences attend to rows they haven't written yet, masked, which must not hold nan
+    ggml_set_zero(cache.k);
+    ggml_set_zero(cache.v);
+
+    cache.alibi = ggml_new_tensor_2d(cache.ctx, GGML_TYPE_F32, hparams.n_ctx, hparams.n_head);
+    gpt_alibi_table((float *) cache.alibi->data, hparams.n_ctx, hparams.n_head, 8.0f);
 
     return true;
 }
 
+// the pages of the kv cache every sequence starts with and gets more of when they run out
+static int kv_cache_pages_step(const struct mpt_hparams & hparams, int n_seq) {
+    return gpt_kv_pages_for(std::min(GPT_KV_CHUNK, hparams.n_ctx), n_seq);
+}
+
+// copy the keys and values of page 'from' of the kv cache 'src' to page 'to' of 'dst' in every layer
+static void kv_cache_copy_page(const struct mpt_hparams & hparams, const struct mpt_kv_cache & src, int from,
+                               struct mpt_kv_cache & dst, int to) {
+    const int n_embd = hparams.n_embd;
+
+    const size_t k_row = gpt_row_size(src.k->type, n_embd);
+    const size_t esize = ggml_element_size(src.v);
+
+    for (int il = 0; il < hparams.n_layer; ++il) {
+        memcpy((char *) dst.k->data + (size_t(il)*dst.n_rows() + size_t(to)*GPT_KV_PAGE)*k_row,
+               (char *) src.k->data + (size_t(il)*src.n_rows() + size_t(from)*GPT_KV_PAGE)*k_row, GPT_KV_PAGE*k_row);
+        for (int i = 0; i < n_embd; ++i) {
+            const size_t dim = size_t(il)*n_embd + i;
+            memcpy((char *) dst.v->data + (dim*dst.n_rows() + size_t(to)*GPT_KV_PAGE)*esize,
+                   (char *) src.v->data + (dim*src.n_rows() + size_t(from)*GPT_KV_PAGE)*esize, GPT_KV_PAGE*esize);
+        }
+    }
+}
+
+// reallocate the kv cache with a pool of n_pages pages, with the contents of every page that is in use
+// moved to the page 'to' gives for it
+static bool kv_cache_move(const struct mpt_hparams & hparams, struct mpt_kv_cache & cache, int n_pages,
+                          const std::vector<int> & to) {
+    mpt_kv_cache moved;
+    if (!kv_cache_init(hparams, moved, cache.k->type, n_pages, cache.n_seq))
+        return false;
+
+    for (int page = 0; page < cache.pages.n_pages(); ++page) {
+        if (cache.pages.refs[page])
+            kv_cache_copy_page(hparams, cache, page, moved, to[page]);
+    }
+
+    std::swap(cache.k, moved.k);
+    std::swap(cache.v, moved.v);
+    std::swap(cache.alibi, moved.alibi);
+    std::swap(cache.ctx, moved.ctx);
+    std::swap(cache.buf.addr, moved.buf.addr);
+    std::swap(cache.buf.size, moved.buf.size);
+    cache.pages.grow(n_pages);
+    cache.pages.move(to);
+    return true;
+}
+
+// reallocate the kv cache with a pool of n_pages pages, keeping its contents
+static bool kv_cache_grow(const struct mpt_hparams & hparams, struct mpt_kv_cache & cache, int n_pages) {
+    if (n_pages <= cache.pages.n_pages())
+        return true;
+
+    std::vector<int> to(n_pages);
+    for (int page = 0; page < n_pages; ++page) {
+        to[page] = page;
+    }
+    return kv_cache_move(hparams, cache, n_pages, to);
+}
+
 // load the model's weights from a stream
 bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
@@ -179,6 +285,10 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         fin.read((char *) &hparams.clip_qkv,  sizeof(hparams.clip_qkv));
         fin.read((char *) &hparams.f16,   sizeof(hparams.f16));
 
+        // ALiBi carries over to positions past those the model was trained with
+        if (model.n_ctx_requested > 0)
+            hparams.n_ctx = model.n_ctx_requested;
+
         printf("%s: n_vocab        = %d\n", __func__, hparams.n_vocab);
         printf("%s: n_ctx          = %d\n", __func__, hparams.n_ctx);
         printf("%s: n_embd         = %d\n", __func__, hparams.n_embd);
@@ -242,6 +352,9 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 
     auto & ctx = model.ctx;
 
+    // use the weights from the page cache if the file can be mapped
+    model.mapping.open(fname);
+
     size_t ctx_size = 0;
 
     {
@@ -270,6 +383,10 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_k
         ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_v
 
+        // the weights stay in the mapped file, the context only holds the tensor objects
+        if (model.mapping.addr)
+            ctx_size = 0;
+
         // TODO probably less now?
         ctx_size += (5 + 10*n_layer)*256; // object overhead
 
@@ -281,7 +398,7 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         struct ggml_init_params params = {
             .mem_size   = ctx_size,
             .mem_buffer = NULL,
-            .no_alloc   = false,
+            .no_alloc   = model.mapping.addr != nullptr,
         };
 
         model.ctx = ggml_init(params);
@@ -334,7 +451,14 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     // key + value memory
     {
         const auto & hparams = model.hparams;
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F16, model.hparams.n_ctx)) {
+
+        // the keys of a head are quantized in blocks of their own
+        if ((hparams.n_embd/hparams.n_head) % ggml_blck_size(model.kv_type) != 0) {
+            fprintf(stderr, "%s: the keys of the attention heads can't be quantized, using f16\n", __func__);
+            model.kv_type = GGML_TYPE_F16;
+        }
+
+        if (!kv_cache_init(hparams, model.kv_self, model.kv_type, kv_cache_pages_step(hparams, 1), 1)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
@@ -347,6 +471,8 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     // load weights
     {
         int n_tensors = 0;
+        int n_mapped = 0;
+        std::vector<std::pair<std::string, size_t>> index; // tensors and the offsets of their data
         size_t total_size = 0;
 
         printf("%s: ", __func__);
@@ -404,7 +530,9 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            // only note where the data is for now
+            index.push_back({ name, size_t(fin.tellg()) });
+            fin.seekg(ggml_nbytes(tensor), std::ios::cur);
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ttype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -414,9 +542,42 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
             }
         }
 
+        // tensors aligned in the mapped file are used from there, the others are filled by a few threads
+        std::vector<gpt_file_range> ranges;
+        for (const auto & [name, offset] : index) {
+            auto tensor = model.tensors[name];
+            if (model.mapping.addr && offset + ggml_nbytes(tensor) > model.mapping.size) {
+                fprintf(stderr, "%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                return false;
+            }
+            if (model.mapping.addr && offset % GPT_MMAP_ALIGN == 0) {
+                tensor->data = (uint8_t *) model.mapping.addr + offset;
+                ++n_mapped;
+                continue;
+            }
+            if (model.mapping.addr) {
+                model.copies.emplace_back(new uint8_t[ggml_nbytes(tensor)]);
+                tensor->data = model.copies.back().get();
+            }
+            ranges.push_back({ offset, ggml_nbytes(tensor), tensor->data });
+        }
+        if (!gpt_read_ranges(fname, model.mapping, ranges)) {
+            fprintf(stderr, "%s: failed to read the tensors from '%s'\n", __func__, fname.c_str());
+            return false;
+        }
+
         printf(" done\n");
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+        if (model.mapping.addr)
+            printf("%s: %d tensors used from the mapped file, %d copied\n", __func__, n_mapped, n_tensors - n_mapped);
+
+        for (const auto & kv : model.tensors) {
+            if (!kv.second->data) {
+                fprintf(stderr, "%s: tensor '%s' is missing from model file\n", __func__, kv.first.c_str());
+                return false;
+            }
+        }
     }
 
     return true;
@@ -436,56 +597,90 @@ bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vo
     return loaded;
 }
 
-bool mpt_eval(
-        mpt_model & model,
-        const int n_threads,
-        const int n_past,
-        const std::vector<int>           & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
-    const int N = embd_inp.size();
+// make 'session' use the weights of 'model' with a kv cache and buffers of its own
+static bool mpt_model_share(const std::shared_ptr<mpt_model> & model, mpt_model & session) {
+    session.hparams  = model->hparams;
+    session.norm_f_w = model->norm_f_w;
+    session.wte      = model->wte;
+    session.layers   = model->layers;
+    session.tensors  = model->tensors;
+    session.ctx      = nullptr;
+    session.weights  = model->weights ? model->weights : model;
+    session.kv_type  = model->kv_type;
+
+    return kv_cache_init(session.hparams, session.kv_self, session.kv_type, kv_cache_pages_step(session.hparams, 1), 1);
+}
+
+// a run of consecutive tokens of one sequence inside of a batched evaluation
+struct mpt_batch_seq {
+    int seq_id;                  // kv cache slot of the sequence
+    int n_past;                  // number of tokens already in the slot
+    const int * tokens;          // tokens to append to the sequence
+    int n_tokens;
+    std::vector<float> * logits; // receives the logits for the last token or, with logits_all, for all of them
+    bool logits_all = false;
+};
 
+// build the graph evaluating a batch into 'gf' and return its logits; the context only holds the
+// tensor objects, the inputs and the logits, the intermediate tensors of the layers go to the scratch
+// buffers. 'tokens' of the sequences may be null when the graph is only built to measure it. The
+// sequences must have the pages of their new tokens in the kv cache, and attend to the positions their
+// 'spans' cover.
+static struct ggml_tensor * mpt_build_graph(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph & gf,
+        const mpt_model & model,
+        const std::vector<mpt_batch_seq> & batch,
+        const std::vector<std::vector<gpt_kv_span>> & spans,
+        const int N,
+        gpt_scratch & scratch,
+        gpt_decode_graph * decode = nullptr) {
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
-
-    const size_t init_buf_size = 1024_MiB;
-    if (!model.buf.addr || model.buf.size < init_buf_size)
-        model.buf.resize(init_buf_size);
 
-    if (mem_per_token > 0 && mem_per_token*N > model.buf.size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        // printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.buf.size, buf_size_new);
+    const auto & pages = model.kv_self.pages;
+    const int n_rows   = model.kv_self.n_rows();
 
-        // reallocate
-        model.buf.resize(buf_size_new);
-        if (model.buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.buf.size);
-            return false;
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    {
+        int off = 0;
+        for (const auto & s : batch) {
+            if (s.tokens)
+                memcpy((int *) embd->data + off, s.tokens, s.n_tokens*ggml_element_size(embd));
+            off += s.n_tokens;
         }
     }
 
-    struct ggml_init_params params = {
-        .mem_size   = model.buf.size,
-        .mem_buffer = model.buf.addr,
-        .no_alloc = false
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    // the rows of the final hidden state whose logits are returned, unless that is all of them
+    struct ggml_tensor * out_rows = nullptr;
+    {
+        int n_out = 0;
+        for (const auto & s : batch) {
+            n_out += s.logits_all ? s.n_tokens : 1;
+        }
+        if (n_out < N) {
+            out_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out);
+            int off = 0, row = 0;
+            for (const auto & s : batch) {
+                for (int i = s.logits_all ? 0 : s.n_tokens - 1; i < s.n_tokens; ++i) {
+                    ((int32_t *) out_rows->data)[row++] = off + i;
+                }
+                off += s.n_tokens;
+            }
+        }
+    }
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    if (decode)
+        decode->embd = embd;
 
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
 
     for (int il = 0; il < n_layer; ++il) {
+        scratch.use(ctx0, 0);
 
         struct ggml_tensor * inpSA = inpL;
         struct ggml_tensor * cur = inpSA;
@@ -502,81 +697,134 @@ bool mpt_eval(
                     model.layers[il].attn_Wqkv_w,
                     cur);
 
-            // TODO: clip_qkv
-            struct ggml_tensor * Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*ggml_element_size(cur)*n_embd));
-            struct ggml_tensor * Kcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*ggml_element_size(cur)*n_embd));
-            struct ggml_tensor * Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*ggml_element_size(cur)*n_embd));
+            // attention output of all sequences, every sequence fills in its own columns below
+            struct ggml_tensor * KQVall = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+            for (int i = 0, off = 0; i < int(batch.size()); off += batch[i].n_tokens, ++i) {
+                const auto & s = batch[i];
+                const int n_past = s.n_past;
+                const int n_tok  = s.n_tokens;
+                const int n_kv   = spans[i].back().pos + spans[i].back().n;
+
+                // the keys of this layer in the kv cache are a row for every token, its values a row of
+                // all tokens for every embedding dimension
+                const size_t k_row  = gpt_row_size(model.kv_self.k->type, n_embd);
+                const size_t esize  = ggml_element_size(model.kv_self.v);
+                const size_t k_base = size_t(il)*n_rows*k_row;
+                const size_t v_base = size_t(il)*n_embd*n_rows*esize;
+
+                // TODO: clip_qkv
+                struct ggml_tensor * Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, n_tok, cur->nb[1], off*cur->nb[1] + 0*ggml_element_size(cur)*n_embd));
+                struct ggml_tensor * Kcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, n_tok, cur->nb[1], off*cur->nb[1] + 1*ggml_element_size(cur)*n_embd));
+                struct ggml_tensor * Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, n_tok, cur->nb[1], off*cur->nb[1] + 2*ggml_element_size(cur)*n_embd));
+
+                // TODO: qk_ln? (seems to be False in MPT-7B configs)
+                // store key and value to memory, in runs of tokens within a page
+                for (int pos = n_past, n_run; pos < n_past + n_tok; pos += n_run) {
+                    n_run = pages.run(pos, n_past + n_tok - pos);
+                    const int row = pages.row(s.seq_id, pos);
+
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, n_run*n_embd, k_base + row*k_row);
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, n_run, n_embd, n_rows*esize, v_base + row*esize);
+                    struct ggml_tensor * k_stored = ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcur, n_run*n_embd, (pos - n_past)*Kcur->nb[1]), k);
+                    struct ggml_tensor * v_stored = ggml_cpy(ctx0,
+                            ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcur, n_embd, n_run, Vcur->nb[1], (pos - n_past)*Vcur->nb[1])), v);
+
+                    ggml_build_forward_expand(&gf, k_stored);
+                    ggml_build_forward_expand(&gf, v_stored);
+
+                    if (decode) {
+                        char * k_layer = (char *) model.kv_self.k->data + k_base;
+                        char * v_layer = (char *) model.kv_self.v->data + v_base;
+                        decode->rows.push_back({ k, i, k_layer, k_row });
+                        decode->rows.push_back({ k_stored, i, k_layer, k_row });
+                        decode->rows.push_back({ v, i, v_layer, esize });
+                        decode->rows.push_back({ v_stored, i, v_layer, esize });
+                    }
+                }
+                // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, Qcur, n_embd/n_head, n_head, n_tok),
+                            0, 2, 1, 3);
+
+                // K * Q for every span of the keys, K = Kmem[rows].view(n_embd/n_head, n_head, n).permute(0, 2, 1, 3),
+                // put together in the order of the positions if there is more than one
+                struct ggml_tensor * KQ = spans[i].size() > 1 ? ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tok, n_head) : nullptr;
+                for (const auto & span : spans[i]) {
+                    struct ggml_tensor * K =
+                        ggml_view_3d(ctx0, model.kv_self.k,
+                                n_embd/n_head, span.n, n_head,
+                                k_row, gpt_row_size(model.kv_self.k->type, n_embd/n_head),
+                                k_base + span.row*k_row);
+                    struct ggml_tensor * KQ_span = ggml_mul_mat(ctx0, K, Q);
+                    if (spans[i].size() == 1) {
+                        KQ = KQ_span;
+                    } else {
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                                KQ_span,
+                                ggml_view_3d(ctx0, KQ, span.n, n_tok, n_head, KQ->nb[1], KQ->nb[2], span.pos*KQ->nb[0])));
+                    }
+                }
+
+                // KQ_scaled = KQ / sqrt(n_embd/n_head)
+                struct ggml_tensor * KQ_scaled =
+                    ggml_scale(ctx0,
+                            KQ,
+                            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
+                            );
+
+
+                // Alibi, the biases of the keys from the table are the same for every query; a single
+                // query has a row for every head
+                struct ggml_tensor * alibi = model.kv_self.alibi;
+                struct ggml_tensor * KQ_bias = ggml_view_3d(ctx0, alibi, n_kv, n_tok, n_head, n_tok == 1 ? alibi->nb[1] : 0, alibi->nb[1], 0);
+                if (n_tok > 1) {
+                    KQ_bias = ggml_cpy(ctx0, KQ_bias, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tok, n_head));
+                }
+                struct ggml_tensor * KQ_scaled_biased = ggml_add(ctx0, KQ_scaled, KQ_bias);
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_biased, n_past);
+
+                if (decode) {
+                    decode->params.push_back({ KQ_masked->src1, i });
+                }
 
-            // TODO: qk_ln? (seems to be False in MPT-7B configs)
-            {
-                Vcur = ggml_transpose(ctx0, Vcur);
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                // KQV = transpose(V) * KQ_soft_max, summed over the spans; V = Vmem[rows].view(n, n_embd/n_head, n_head)
+                struct ggml_tensor * KQV = nullptr;
+                for (const auto & span : spans[i]) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, model.kv_self.v,
+                                span.n, n_embd/n_head, n_head,
+                                n_rows*esize, n_embd/n_head*n_rows*esize,
+                                v_base + span.row*esize);
+                    struct ggml_tensor * KQ_span = spans[i].size() == 1 ? KQ_soft_max :
+                        ggml_view_3d(ctx0, KQ_soft_max, span.n, n_tok, n_head,
+                                KQ_soft_max->nb[1], KQ_soft_max->nb[2], span.pos*KQ_soft_max->nb[0]);
+                    struct ggml_tensor * KQV_span = ggml_mul_mat(ctx0, V, KQ_span);
+                    KQV = KQV ? ggml_add(ctx0, KQV, KQV_span) : KQV_span;
+                }
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
-                                        (   n_ctx)*ggml_element_size(model.kv_self.v),
-                                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                // KQVall[:, off:off + N] = KQV_merged.contiguous().view(n_embd, N)
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_view_2d(ctx0, KQVall, n_embd, n_tok, KQVall->nb[1], off*KQVall->nb[1])));
             }
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_embd/n_head, n_head, N),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-
-            // Alibi
-            struct ggml_tensor * KQ_scaled_biased = ggml_alibi(ctx0, ggml_cont(ctx0, KQ_scaled), n_past, n_head);
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_biased, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, model.kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(model.kv_self.v),
-                        n_ctx*ggml_element_size(model.kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd);
-
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
 
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
                     model.layers[il].attn_out_proj_w,
-                    cur);
+                    KQVall);
         }
 
+        scratch.use(ctx0, 1);
 
         // residual
         struct ggml_tensor * resSA = ggml_add(ctx0, cur, inpSA);
@@ -603,6 +851,12 @@ bool mpt_eval(
         inpL = ggml_add(ctx0, cur, resSA);
     }
 
+    scratch.use(ctx0, 0);
+
+    // only those rows go through the final norm and the lm head
+    if (out_rows)
+        inpL = ggml_get_rows(ctx0, inpL, out_rows);
+
     struct ggml_tensor * out = inpL;
     // -> logits
     {
@@ -610,153 +864,566 @@ bool mpt_eval(
         out = ggml_mul(ctx0,
                     ggml_repeat(ctx0, model.norm_f_w, out),
                     out);
+        scratch.use(ctx0, -1);
         out = ggml_mul_mat(ctx0, model.wte, out);
     }
 
 
-    // run the computation
     ggml_build_forward_expand(&gf, out);
-    ggml_graph_compute       (ctx0, &gf);
 
+    return out;
+}
+
+// generous bound of what the context and each of the scratch buffers of a graph for 'n_tokens' tokens
+// of 'n_seq' sequences attending to up to 'n_kv' tokens each take, for the memory it is measured in
+static size_t mpt_eval_bound(const mpt_hparams & hparams, int n_tokens, int n_seq, int n_kv) {
+    const size_t N = n_tokens;
+    const size_t n_embd = hparams.n_embd;
+    const size_t n_head = hparams.n_head;
+
+    const size_t layer = 64*N*n_embd + 4*n_seq*size_t(n_embd)*GPT_KV_MAX_SPANS + 12*n_head*N*n_kv;
+    const size_t ctx = 2*N*n_embd + 2*N*hparams.n_vocab;
+    const size_t objects = 4*size_t(GGML_MAX_NODES)*512;
+    return sizeof(float)*std::max(layer, ctx) + objects + 1_MiB;
+}
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(out) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+// nodes a sequence takes in the graph of every layer, generously
+static int mpt_seq_nodes(const mpt_batch_seq & s, size_t n_spans) {
+    const int n_runs = (s.n_past%GPT_KV_PAGE + s.n_tokens + GPT_KV_PAGE - 1)/GPT_KV_PAGE;
+    return 16 + 8*n_runs + 8*int(n_spans);
+}
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+// end of the sequences of a batch from 'begin' on that a graph has room for, which ggml limits to
+// GGML_MAX_NODES nodes; at least one of them
+static size_t mpt_graph_group(const mpt_hparams & hparams, const std::vector<mpt_batch_seq> & batch,
+                              const std::vector<std::vector<gpt_kv_span>> & spans, size_t begin) {
+    int n_nodes = 32 + 20*hparams.n_layer;
+    size_t end = begin;
+    for (; end < batch.size(); ++end) {
+        n_nodes += hparams.n_layer*mpt_seq_nodes(batch[end], spans[end].size());
+        if (end > begin && n_nodes > GGML_MAX_NODES)
+            break;
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+    return end;
+}
+
+// size the memory for evaluating the graph of batches of up to 'n_tokens' tokens by building the
+// graph of the largest batch without computing it; the reservations it is built in are generous, but
+// only the pages that tensor objects and operator parameters land on are ever touched
+static bool mpt_eval_plan(mpt_model & model, const int n_tokens, const int n_threads) {
+    const auto & hparams = model.hparams;
 
+    // the kept graph is in the memory about to be replaced
+    model.graph.reset();
+
+    // the worst case: the tokens spread over as many sequences as a graph has room for, each filling
+    // the context in as many spans as it may take and asking for the logits of all of its tokens; the
+    // first span is nearly all of the context, for the largest products with the values
+    const int n_seq_max = std::min(n_tokens, model.kv_self.n_seq);
+    const int n_ctx = hparams.n_ctx;
+    std::vector<mpt_batch_seq> batch;
+    std::vector<std::vector<gpt_kv_span>> spans;
+    for (int n_seq = n_seq_max; n_seq > 0; --n_seq) {
+        batch.clear();
+        spans.assign(n_seq, {});
+        for (int i = 0; i < n_seq; ++i) {
+            const int n_tok = n_tokens/n_seq + (i < n_tokens%n_seq);
+            batch.push_back({ i, std::max(n_ctx - n_tok, 0), nullptr, n_tok, nullptr, true });
+            const int n_kv    = batch[i].n_past + n_tok;
+            const int n_spans = std::min(GPT_KV_MAX_SPANS, n_kv);
+            for (int k = 0, pos = 0; k < n_spans; pos += spans[i].back().n, ++k) {
+                spans[i].push_back({ pos, 0, k ? 1 : n_kv - n_spans + 1 });
+            }
+        }
+        if (mpt_graph_group(hparams, batch, spans, 0) == batch.size())
+            break;
+    }
+    const int n_seq = batch.size();
+
+    const size_t bound = mpt_eval_bound(hparams, n_tokens, n_seq, std::max(n_ctx, n_tokens));
+    mpt_buffer reserved[3];
+    for (auto & buf : reserved) {
+        buf.addr = new (std::nothrow) uint8_t[bound];
+        buf.size = bound;
+        if (!buf.addr) {
+            fprintf(stderr, "%s: failed to reserve %zu bytes\n", __func__, bound);
+            return false;
+        }
+    }
+
+    struct ggml_init_params params = {
+        .mem_size   = reserved[0].size,
+        .mem_buffer = reserved[0].addr,
+        .no_alloc = false
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
+
+    gpt_scratch scratch;
+    scratch.buf[0] = { 0, reserved[1].size, reserved[1].addr };
+    scratch.buf[1] = { 0, reserved[2].size, reserved[2].addr };
+    mpt_build_graph(ctx0, gf, model, batch, spans, n_tokens, scratch);
+
+    // the graphs of other batches are no larger than ggml allows, but may have more tensor objects than
+    // measured, about two for every node; the tensors of their sequences beyond those measured are
+    // aligned in the scratch buffers, which takes up to 16 bytes for each of their 32 or so tensors
+    const size_t n_unmeasured = n_seq_max - n_seq;
+    const size_t ctx_size = ggml_used_mem(ctx0) + 2*size_t(GGML_MAX_NODES)*512 + gpt_graph_work_size(gf, n_threads);
     ggml_free(ctx0);
 
+    model.buf.resize(ctx_size);
+    model.scr0.resize(scratch.peak[0] + n_unmeasured*32*16);
+    model.scr1.resize(scratch.peak[1] + n_unmeasured*32*16);
+    model.n_batch_planned = n_tokens;
+    model.n_threads_planned = n_threads;
     return true;
 }
 
+// let a sequence write its tokens [n_from, n_to) to the kv cache: the pages it lacks for them are taken
+// from the pool, which grows if it runs out of them, and the pages it shares get copied
+static bool mpt_kv_prepare(mpt_model & model, int seq_id, int n_from, int n_to) {
+    auto & cache = model.kv_self;
+    const int n_missing = cache.pages.missing(seq_id, n_from, n_to);
+    if (n_missing > cache.pages.n_free()) {
+        const int n_max   = gpt_kv_pages_for(model.hparams.n_ctx, cache.n_seq);
+        const int n_pages = std::min(n_max, cache.pages.n_pages()
+            + std::max(kv_cache_pages_step(model.hparams, cache.n_seq), n_missing - cache.pages.n_free()));
+        if (n_missing > n_pages - cache.pages.n_pages() + cache.pages.n_free()) {
+            fprintf(stderr, "%s: no room for %d pages in the kv cache\n", __func__, n_missing);
+            return false;
+        }
+        // the kept graph points into the kv cache
+        model.graph.reset();
+        if (!kv_cache_grow(model.hparams, cache, n_pages)) {
+            fprintf(stderr, "%s: failed to grow the kv cache\n", __func__);
+            return false;
+        }
+    }
+
+    std::vector<std::pair<int, int>> copies;
+    cache.pages.prepare(seq_id, n_from, n_to, copies);
+    for (const auto & [from, to] : copies) {
+        kv_cache_copy_page(model.hparams, cache, from, cache, to);
+    }
+    return true;
+}
+
+// find the spans of the kv cache the sequences of a batch attend to; if a sequence is spread over too
+// many of them, the pages of the pool are laid out again, and a sequence that stays spread over the pages
+// of those it shares them with gets copies of its own
+static bool mpt_kv_spans(mpt_model & model, const std::vector<mpt_batch_seq> & batch, bool decoding,
+                         std::vector<std::vector<gpt_kv_span>> & spans) {
+    auto & cache = model.kv_self;
+    for (int attempt = 0; ; ++attempt) {
+        bool spread = false;
+        spans.assign(batch.size(), {});
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const auto & s = batch[i];
+            const int n_kv = decoding ? gpt_decode_n_kv(s.n_past, s.n_tokens, model.hparams.n_ctx) : s.n_past + s.n_tokens;
+            cache.pages.spans(s.seq_id, n_kv, spans[i]);
+            if (int(spans[i].size()) <= GPT_KV_MAX_SPANS)
+                continue;
+            spread = true;
+            if (attempt == 1 && !mpt_kv_prepare(model, s.seq_id, 0, s.n_past + s.n_tokens))
+                return false;
+        }
+        if (!spread)
+            return true;
+        if (attempt == 2) {
+            fprintf(stderr, "%s: the kv cache is too fragmented\n", __func__);
+            return false;
+        }
+
+        const std::vector<int> to = cache.pages.layout();
+        bool moved = false;
+        for (int page = 0; page < cache.pages.n_pages(); ++page) {
+            moved |= cache.pages.refs[page] && to[page] != page;
+        }
+        if (!moved)
+            continue;
+        // the kept graph points into the kv cache
+        model.graph.reset();
+        if (!kv_cache_move(model.hparams, cache, cache.pages.n_pages(), to)) {
+            fprintf(stderr, "%s: failed to lay out the kv cache\n", __func__);
+            return false;
+        }
+    }
+}
+
+// evaluate the sequences of a batch with a single graph, the kept one if it matches them when 'decoding'
+static bool mpt_eval_graph(
+        mpt_model & model,
+        const int n_threads,
+        const std::vector<mpt_batch_seq> & batch,
+        const std::vector<std::vector<gpt_kv_span>> & spans,
+        const bool decoding) {
+    const int n_vocab = model.hparams.n_vocab;
+
+    int N = 0;
+    std::vector<int> seq_ids, n_kv, n_past;
+    std::vector<gpt_kv_span> all_spans;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        N += batch[i].n_tokens;
+        seq_ids.push_back(batch[i].seq_id);
+        n_kv.push_back(spans[i].back().pos + spans[i].back().n);
+        n_past.push_back(batch[i].n_past);
+        all_spans.insert(all_spans.end(), spans[i].begin(), spans[i].end());
+    }
 
-#define MPT_MAX_RNG_STATE 64*1024
+    auto & graph = model.graph;
+    if (decoding && graph.matches(seq_ids, n_kv, n_threads, all_spans)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            ((int *) graph.embd->data)[i] = batch[i].tokens[0];
+        }
+    } else {
+        graph.reset();
+
+        struct ggml_init_params params = {
+            .mem_size   = model.buf.size,
+            .mem_buffer = model.buf.addr,
+            .no_alloc = false
+        };
 
-size_t mpt_get_state_size(const mpt_model &model)
+        graph.ctx = ggml_init(params);
+        graph.gf.reset(new ggml_cgraph {});
+        graph.gf->n_threads = n_threads;
+
+        gpt_scratch scratch;
+        scratch.buf[0] = { 0, model.scr0.size, model.scr0.addr };
+        scratch.buf[1] = { 0, model.scr1.size, model.scr1.addr };
+        graph.logits = mpt_build_graph(graph.ctx, *graph.gf, model, batch, spans, N, scratch, decoding ? &graph : nullptr);
+        if (decoding)
+            graph.keep(scratch, std::move(seq_ids), std::move(n_kv), n_threads, std::move(all_spans));
+    }
+    graph.patch(n_past, model.kv_self.pages);
+
+    // run the computation
+    ggml_graph_compute(graph.ctx, graph.gf.get());
+    struct ggml_tensor * out = graph.logits;
+
+    // return result for just the last token of every sequence, or all of them if requested; only
+    // those rows were computed, one after the other
+    {
+        int row = 0;
+        for (const auto & s : batch) {
+            const int n_rows = s.logits_all ? s.n_tokens : 1;
+            s.logits->resize(n_vocab*n_rows);
+            memcpy(s.logits->data(), (float *) ggml_get_data(out) + (n_vocab*row), sizeof(float)*n_vocab*n_rows);
+            row += n_rows;
+            model.kv_self.n[s.seq_id] = s.n_past + s.n_tokens;
+        }
+    }
+
+    //printf("used_mem = %zu\n", ggml_used_mem(graph.ctx));
+
+    if (!decoding)
+        graph.reset();
+
+    return true;
+}
+
+// evaluate the transformer for several independent sequences at once, each of them attending only
+// to its own tokens in the kv cache; they share a graph as far as it has room for them
+bool mpt_eval_batch(
+        mpt_model & model,
+        const int n_threads,
+        const std::vector<mpt_batch_seq> & batch) {
+    const auto & hparams = model.hparams;
+
+    const int n_ctx = hparams.n_ctx;
+
+    int N = 0;
+    std::vector<bool> seq_used(model.kv_self.n_seq, false);
+    for (const auto & s : batch) {
+        if (s.seq_id < 0 || s.seq_id >= model.kv_self.n_seq || seq_used[s.seq_id]) {
+            fprintf(stderr, "%s: invalid or duplicate sequence %d\n", __func__, s.seq_id);
+            return false;
+        }
+        if (s.n_past + s.n_tokens > n_ctx) {
+            fprintf(stderr, "%s: sequence %d exceeds the context window\n", __func__, s.seq_id);
+            return false;
+        }
+        seq_used[s.seq_id] = true;
+        N += s.n_tokens;
+    }
+
+    // the sequences continue after their first n_past tokens
+    for (const auto & s : batch) {
+        model.kv_self.pages.truncate(s.seq_id, s.n_past);
+        if (!mpt_kv_prepare(model, s.seq_id, s.n_past, s.n_past + s.n_tokens))
+            return false;
+    }
+
+    // single tokens of the sequences are evaluated with the graph of the previous step if it was for
+    // the same sequences and rows of the kv cache
+    const bool decoding = N == int(batch.size());
+    std::vector<std::vector<gpt_kv_span>> spans;
+    if (!mpt_kv_spans(model, batch, decoding, spans))
+        return false;
+
+    if (N > model.n_batch_planned || n_threads > model.n_threads_planned) {
+        if (!mpt_eval_plan(model, std::max(N, model.n_batch_planned), std::max(n_threads, model.n_threads_planned)))
+            return false;
+    }
+
+    // the sequences are evaluated in as few graphs as they fit in, a graph of a decoding step is only
+    // kept if it has all of them
+    for (size_t begin = 0, end; begin < batch.size(); begin = end) {
+        end = mpt_graph_group(hparams, batch, spans, begin);
+        const std::vector<mpt_batch_seq> group(batch.begin() + begin, batch.begin() + end);
+        const std::vector<std::vector<gpt_kv_span>> group_spans(spans.begin() + begin, spans.begin() + end);
+        if (!mpt_eval_graph(model, n_threads, group, group_spans, decoding && end - begin == batch.size()))
+            return false;
+    }
+    return true;
+}
+
+bool mpt_eval(
+        mpt_model & model,
+        const int n_threads,
+        const int n_past,
+        const std::vector<int>           & embd_inp,
+              std::vector<float>         & embd_w,
+        const int seq_id = 0) {
+    return mpt_eval_batch(model, n_threads,
+        { { seq_id, n_past, embd_inp.data(), int(embd_inp.size()), &embd_w } });
+}
+
+
+// remove n_discard tokens following the first n_keep from the kv cache of a sequence by moving the
+// entries behind them forward; ALiBi only depends on the distance between positions so the moved
+// entries stay valid as they are
+static bool mpt_kv_shift(mpt_model & model, int seq_id, int n_past, int n_keep, int n_discard) {
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+
+    const int n_left = n_past - n_discard;
+    if (!mpt_kv_prepare(model, seq_id, n_keep, n_left))
+        return false;
+
+    const auto & pages = model.kv_self.pages;
+    const int n_rows   = model.kv_self.n_rows();
+    const size_t k_row = gpt_row_size(model.kv_self.k->type, n_embd);
+    const size_t esize = ggml_element_size(model.kv_self.v);
+
+    // the runs of tokens that stay within a page both where they are and where they move to
+    for (int pos = n_keep, n_run; pos < n_left; pos += n_run) {
+        n_run = std::min(pages.run(pos, n_left - pos), pages.run(pos + n_discard, n_left - pos));
+        const size_t to   = pages.row(seq_id, pos);
+        const size_t from = pages.row(seq_id, pos + n_discard);
+
+        for (int il = 0; il < n_layer; ++il) {
+            char * k = (char *) model.kv_self.k->data + size_t(il)*n_rows*k_row;
+            memmove(k + to*k_row, k + from*k_row, n_run*k_row);
+
+            // the values are stored transposed so every embedding dimension is a row of its own
+            for (int i = 0; i < n_embd; ++i) {
+                char * v = (char *) model.kv_self.v->data + (size_t(il)*n_embd + i)*n_rows*esize;
+                memmove(v + to*esize, v + from*esize, n_run*esize);
+            }
+        }
+    }
+    model.kv_self.pages.truncate(seq_id, n_left);
+    model.kv_self.n[seq_id] = n_left;
+    return true;
+}
+
+// call 'f' with every contiguous run of the kv cache entries of a sequence from its n_from-th to its n-th token
+template <typename F>
+static void mpt_state_kv_runs(const mpt_model & model, int seq_id, int n_from, int n, F && f) {
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_rows  = model.kv_self.n_rows();
+
+    const auto & pages = model.kv_self.pages;
+    const size_t k_row = gpt_row_size(model.kv_self.k->type, n_embd);
+    const size_t esize = ggml_element_size(model.kv_self.v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const size_t layer = size_t(il)*n_rows;
+        for (int pos = n_from, n_run; pos < n; pos += n_run) {
+            n_run = pages.run(pos, n - pos);
+            f((char *) model.kv_self.k->data + (layer + pages.row(seq_id, pos))*k_row, n_run*k_row);
+        }
+
+        // the values are stored transposed so every embedding dimension is a run of its own
+        for (int i = 0; i < n_embd; ++i) {
+            const size_t dim = (size_t(il)*n_embd + i)*n_rows;
+            for (int pos = n_from, n_run; pos < n; pos += n_run) {
+                n_run = pages.run(pos, n - pos);
+                f((char *) model.kv_self.v->data + (dim + pages.row(seq_id, pos))*esize, n_run*esize);
+            }
+        }
+    }
+}
+
+// The state holds the rng and, for every sequence, the kv cache entries of its tokens from the n_from-th on:
+//
+//   magic, number of rng words, GPT_RNG_STATE_WORDS rng words, type of the keys, n_seq, n_from
+//   for every sequence: its number of tokens n, the entries of tokens n_from..n-1 of each layer's K and V
+//
+// With a seq_id it only holds that sequence, and can be restored into any slot of the kv cache.
+//
+size_t mpt_get_state_size(const mpt_model &model, int n_from, int seq_id = -1)
 {
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = MPT_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
+    const int seq_begin = seq_id < 0 ? 0 : seq_id;
+    const int seq_end   = seq_id < 0 ? model.kv_self.n_seq : seq_id + 1;
+
+    size_t s_kv = 0;
+    for (int seq_id = seq_begin; seq_id < seq_end; ++seq_id) {
+        s_kv += sizeof(int);
+        mpt_state_kv_runs(model, seq_id, n_from, model.kv_self.n[seq_id], [&s_kv](char *, size_t size) {
+            s_kv += size;
+        });
+    }
     const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
+        + sizeof(uint32_t)                           // magic
+        + sizeof(uint32_t)                           // number of rng words
+        + sizeof(uint32_t)*GPT_RNG_STATE_WORDS       // rng
+        + sizeof(int)                                // type of the keys
+        + sizeof(int)                                // n_seq
+        + sizeof(int)                                // n_from
         + s_kv
     );
-    fflush(stdout);
     return s_total;
 }
 
-size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint8_t *dest)
+size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint8_t *dest, int n_from, int seq_id = -1)
 {
     uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
 
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[MPT_MAX_RNG_STATE];
+    const uint32_t magic = GPT_STATE_MAGIC;
+    memcpy(out, &magic, sizeof(magic)); out += sizeof(magic);
 
-        memset(&rng_buf[0], 0, MPT_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
+    // copy rng
+    {
+        uint32_t rng_words[GPT_RNG_STATE_WORDS] = {};
+        const uint32_t n_words = gpt_rng_save(rng, rng_words);
 
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], MPT_MAX_RNG_STATE); out += MPT_MAX_RNG_STATE;
+        memcpy(out, &n_words,  sizeof(n_words));  out += sizeof(n_words);
+        memcpy(out, rng_words, sizeof(rng_words)); out += sizeof(rng_words);
     }
 
-    // copy kv cache
+    // copy the kv cache entries in use
     {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
+        const int seq_begin = seq_id < 0 ? 0 : seq_id;
+        const int seq_end   = seq_id < 0 ? model.kv_self.n_seq : seq_id + 1;
+        const int n_seq     = seq_end - seq_begin;
+
+        const int k_type    = model.kv_self.k->type;
 
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
+        memcpy(out, &k_type, sizeof(k_type)); out += sizeof(k_type);
+        memcpy(out, &n_seq,  sizeof(n_seq));  out += sizeof(n_seq);
+        memcpy(out, &n_from, sizeof(n_from)); out += sizeof(n_from);
 
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
+        for (int seq_id = seq_begin; seq_id < seq_end; ++seq_id) {
+            const int n = model.kv_self.n[seq_id];
+            memcpy(out, &n, sizeof(n)); out += sizeof(n);
+
+            mpt_state_kv_runs(model, seq_id, n_from, n, [&out](char * data, size_t size) {
+                memcpy(out, data, size); out += size;
+            });
         }
     }
 
     const size_t written  = out - dest;
-    assert(written == mpt_get_state_size(model));
-    fflush(stdout);
+    assert(written == mpt_get_state_size(model, n_from, seq_id));
     return written;
 }
 
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src)
+size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src, int seq_id = -1)
 {
     const uint8_t * in = src;
 
+    uint32_t magic;
+    memcpy(&magic, in, sizeof(magic)); in += sizeof(magic);
+    if (magic != GPT_STATE_MAGIC) {
+        // states saved before hold the kv cache in a layout it doesn't have anymore, so the caller has to
+        // evaluate the tokens again
+        fprintf(stderr, "%s: the state is of an older format\n", __func__);
+        return 0;
+    }
+
     // set rng
     {
-        size_t rng_size;
-        char   rng_buf[MPT_MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, MPT_MAX_RNG_STATE); in += MPT_MAX_RNG_STATE;
+        uint32_t n_words;
+        uint32_t rng_words[GPT_RNG_STATE_WORDS];
 
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+        memcpy(&n_words,  in, sizeof(n_words));  in += sizeof(n_words);
+        memcpy(rng_words, in, sizeof(rng_words)); in += sizeof(rng_words);
 
-        assert(rng_ss.fail() == false);
+        if (!gpt_rng_load(*rng, rng_words, std::min<size_t>(n_words, GPT_RNG_STATE_WORDS))) {
+            fprintf(stderr, "%s: invalid rng state\n", __func__);
+            return 0;
+        }
     }
 
-    // set kv cache
+    // set the kv cache entries
     {
-        size_t kv_size;
-        int kv_ntok;
+        int k_type, n_seq, n_from;
 
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+        memcpy(&k_type, in, sizeof(k_type)); in += sizeof(k_type);
+        memcpy(&n_seq,  in, sizeof(n_seq));  in += sizeof(n_seq);
+        memcpy(&n_from, in, sizeof(n_from)); in += sizeof(n_from);
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+        if (k_type != model->kv_self.k->type) {
+            fprintf(stderr, "%s: state for keys of type %d, but the kv cache has %d\n", __func__, k_type, model->kv_self.k->type);
+            return 0;
+        }
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+        if (seq_id < 0 ? n_seq != model->kv_self.n_seq : n_seq != 1 || seq_id >= model->kv_self.n_seq) {
+            fprintf(stderr, "%s: state for %d sequences, but the kv cache has %d\n", __func__, n_seq, model->kv_self.n_seq);
+            return 0;
+        }
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+        for (int i = 0; i < n_seq; ++i) {
+            const int seq = seq_id < 0 ? i : seq_id;
+            int n;
+            memcpy(&n, in, sizeof(n)); in += sizeof(n);
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+            if (n > n_from && n_from > model->kv_self.n[seq]) {
+                fprintf(stderr, "%s: state starts after token %d, but sequence %d has %d\n", __func__,
+                    n_from, seq, model->kv_self.n[seq]);
+                return 0;
+            }
+            model->kv_self.pages.truncate(seq, std::min(n, n_from));
+            if (n > model->hparams.n_ctx || !mpt_kv_prepare(*model, seq, n_from, n)) {
+                fprintf(stderr, "%s: failed to make room for %d tokens in the kv cache\n", __func__, n);
+                return 0;
+            }
 
+            mpt_state_kv_runs(*model, seq, n_from, n, [&in](char * data, size_t size) {
+                memcpy(data, in, size); in += size;
+            });
+            model->kv_self.n[seq] = n;
         }
-
-        model->kv_self.n = kv_ntok;
     }
 
     const size_t nread    = in - src;
-    assert(nread == mpt_get_state_size(*model));
-    fflush(stdout);
     return nread;
 }
 
 struct MPTPrivate {
     const std::string modelPath;
     bool modelLoaded;
-    gpt_vocab vocab;
-    mpt_model *model = nullptr;
+    std::shared_ptr<gpt_vocab> vocab;
+    std::shared_ptr<mpt_model> model;
     int64_t n_threads = 0;
-    size_t mem_per_token = 0;
     std::mt19937 rng;
+    gpt_sampler_buffers sampler;
     bool has_im_end = false;
 };
 
 MPT::MPT()
     : d_ptr(new MPTPrivate) {
-    d_ptr->model = new mpt_model;
+    d_ptr->vocab = std::make_shared<gpt_vocab>();
+    d_ptr->model = std::make_shared<mpt_model>();
     d_ptr->model->ctx = nullptr;
     d_ptr->modelLoaded = false;
 }
@@ -764,18 +1431,20 @@ MPT::MPT()
 bool MPT::loadModel(const std::string &modelPath) {
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
+    d_ptr->model->kv_type = gpt_kv_type(m_loadOptions.kvType);
+    d_ptr->model->n_ctx_requested = m_loadOptions.n_ctx;
 
     auto fin = std::ifstream(modelPath, std::ios::binary);
 
     // load the model
-    if (!mpt_model_load(modelPath, fin, *d_ptr->model, d_ptr->vocab)) {
+    if (!mpt_model_load(modelPath, fin, *d_ptr->model, *d_ptr->vocab)) {
         std::cerr << "MPT ERROR: failed to load model from " <<  modelPath;
         return false;
     }
 
     d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
     d_ptr->modelLoaded = true;
-    d_ptr->has_im_end = d_ptr->vocab.token_to_id.find("<|im_end|>") != d_ptr->vocab.token_to_id.end();
+    d_ptr->has_im_end = d_ptr->vocab->token_to_id.find("<|im_end|>") != d_ptr->vocab->token_to_id.end();
     fflush(stdout);
     return true;
 }
@@ -789,9 +1458,70 @@ int32_t MPT::threadCount() const
     return d_ptr->n_threads;
 }
 
+bool MPT::setSequenceCount(int32_t n_seq)
+{
+    if (n_seq < 1)
+        return false;
+    auto & model = *d_ptr->model;
+    if (n_seq == model.kv_self.n_seq)
+        return true;
+    // the evaluation memory was planned for batches spread over the previous number of sequences
+    model.n_batch_planned = 0;
+    model.graph.reset();
+    return kv_cache_init(model.hparams, model.kv_self, model.kv_type, kv_cache_pages_step(model.hparams, n_seq), n_seq);
+}
+
+int32_t MPT::sequenceCount() const
+{
+    return d_ptr->model->kv_self.n_seq;
+}
+
+bool MPT::forkSequence(int32_t src, int32_t dst, int32_t n_tokens)
+{
+    auto & cache = d_ptr->model->kv_self;
+    if (src < 0 || src >= cache.n_seq || dst < 0 || dst >= cache.n_seq || n_tokens < 0 || n_tokens > cache.n[src])
+        return false;
+    cache.pages.fork(src, dst, n_tokens);
+    cache.n[dst] = n_tokens;
+    return true;
+}
+
+size_t MPT::sequenceMemorySize() const
+{
+    if (!d_ptr->modelLoaded)
+        return 0;
+    const auto & hparams = d_ptr->model->hparams;
+    // only the keys are quantized, the values of a token take the same memory at any kv type
+    const size_t row_size = gpt_row_size(d_ptr->model->kv_type, hparams.n_embd) + gpt_row_size(GGML_TYPE_F16, hparams.n_embd);
+    return size_t(hparams.n_layer)*hparams.n_ctx*row_size;
+}
+
 MPT::~MPT()
 {
-    delete d_ptr->model;
+    delete d_ptr;
+}
+
+LLModel *MPT::newSession() const
+{
+    if (!d_ptr->modelLoaded)
+        return nullptr;
+
+    auto model = std::make_shared<mpt_model>();
+    if (!mpt_model_share(d_ptr->model, *model)) {
+        fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
+        return nullptr;
+    }
+
+    MPT *session = new MPT;
+    session->d_ptr->model = model;
+    session->d_ptr->vocab = d_ptr->vocab;
+    session->d_ptr->n_threads = d_ptr->n_threads;
+    session->d_ptr->rng.seed(d_ptr->rng());
+    session->d_ptr->has_im_end = d_ptr->has_im_end;
+    session->d_ptr->modelLoaded = true;
+    session->m_implementation = m_implementation;
+    session->m_loadOptions = m_loadOptions;
+    return session;
 }
 
 bool MPT::isModelLoaded() const
@@ -801,52 +1531,94 @@ bool MPT::isModelLoaded() const
 
 size_t MPT::stateSize() const
 {
-    return mpt_get_state_size(*d_ptr->model);
+    return mpt_get_state_size(*d_ptr->model, 0);
 }
 
 size_t MPT::saveState(uint8_t *dest) const
 {
-    return mpt_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return mpt_copy_state_data(*d_ptr->model, d_ptr->rng, dest, 0);
 }
 
 size_t MPT::restoreState(const uint8_t *src)
 {
-    return mpt_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return mpt_set_state_data(d_ptr->model.get(), &d_ptr->rng, src);
+}
+
+size_t MPT::stateSizeFrom(int32_t n_from) const
+{
+    return mpt_get_state_size(*d_ptr->model, n_from);
+}
+
+size_t MPT::saveStateFrom(uint8_t *dest, int32_t n_from) const
+{
+    return mpt_copy_state_data(*d_ptr->model, d_ptr->rng, dest, n_from);
+}
+
+size_t MPT::sequenceStateSize(int32_t seq_id, int32_t n_from) const
+{
+    if (seq_id < 0 || seq_id >= d_ptr->model->kv_self.n_seq)
+        return 0;
+    return mpt_get_state_size(*d_ptr->model, n_from, seq_id);
+}
+
+size_t MPT::saveSequenceState(int32_t seq_id, uint8_t *dest, int32_t n_from) const
+{
+    if (seq_id < 0 || seq_id >= d_ptr->model->kv_self.n_seq)
+        return 0;
+    return mpt_copy_state_data(*d_ptr->model, d_ptr->rng, dest, n_from, seq_id);
+}
+
+size_t MPT::restoreSequenceState(int32_t seq_id, const uint8_t *src)
+{
+    if (seq_id < 0)
+        return 0;
+    return mpt_set_state_data(d_ptr->model.get(), &d_ptr->rng, src, seq_id);
 }
 
 std::vector<LLModel::Token> MPT::tokenize(PromptContext &, const std::string &str) const
 {
-    return ::gpt_tokenize(d_ptr->vocab, str);
+    return ::gpt_tokenize(*d_ptr->vocab, str);
 }
 
 std::string MPT::tokenToString(Token id) const
 {
-    return d_ptr->vocab.id_to_token[id];
+    // the vocabulary may be shared with other sessions, so it must not be modified
+    const auto it = d_ptr->vocab->id_to_token.find(id);
+    return it != d_ptr->vocab->id_to_token.end() ? it->second : std::string();
 }
 
 LLModel::Token MPT::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return gpt_sample_token(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab,
+        d_ptr->rng, d_ptr->sampler);
 }
 
 bool MPT::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
-    // determine the required inference memory per token:
-    static bool initialized = false;
-    if (!initialized) {
-        mpt_eval(*d_ptr->model, d_ptr->n_threads, 0, { 0, 1, 2, 3 }, ctx.logits,
-            d_ptr->mem_per_token);
-        initialized = true;
-    }
+    return mpt_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, ctx.seq_id);
+}
 
-    return mpt_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+bool MPT::evalTokensAll(PromptContext &ctx, const std::vector<int32_t> &tokens, std::vector<float> &logits) const
+{
+    mpt_batch_seq seq = { ctx.seq_id, ctx.n_past, tokens.data(), int(tokens.size()), &logits };
+    seq.logits_all = true;
+    return mpt_eval_batch(*d_ptr->model, d_ptr->n_threads, { seq });
+}
+
+bool MPT::evalBatch(const std::vector<PromptContext*> &ctxs, const std::vector<Token> &tokens) const
+{
+    std::vector<mpt_batch_seq> batch;
+    batch.reserve(ctxs.size());
+    for (size_t i = 0; i < ctxs.size(); ++i)
+        batch.push_back({ ctxs[i]->seq_id, ctxs[i]->n_past, &tokens[i], 1, &ctxs[i]->logits });
+    return mpt_eval_batch(*d_ptr->model, d_ptr->n_threads, batch);
+}
+
+bool MPT::shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard)
+{
+    if (n_keep < 0 || n_discard <= 0 || n_keep + n_discard > ctx.n_past)
+        return false;
+    return mpt_kv_shift(*d_ptr->model, ctx.seq_id, ctx.n_past, n_keep, n_discard);
 }
 
 int32_t MPT::contextLength() const
@@ -856,7 +1628,11 @@ int32_t MPT::contextLength() const
 
 const std::vector<LLModel::Token> &MPT::endTokens() const
 {
-    static const std::vector<LLModel::Token> fres = {0, d_ptr->vocab.token_to_id["<|im_end|>"]};
+    // looked up without modifying the vocabulary, which may be shared with other sessions
+    static const std::vector<LLModel::Token> fres = [this] {
+        const auto it = d_ptr->vocab->token_to_id.find("<|im_end|>");
+        return std::vector<LLModel::Token>{0, it != d_ptr->vocab->token_to_id.end() ? it->second : 0};
+    }();
     return fres;
 }
 
@@ -879,6 +1655,13 @@ DLL_EXPORT const char *get_build_variant() {
     return GGML_BUILD_VARIANT;
 }
 
+DLL_EXPORT void get_file_signature(uint32_t *magic, uint32_t *min_version, uint32_t *max_version) {
+    // there is no version field to check
+    *magic = 0x67676d6d;
+    *min_version = 0;
+    *max_version = std::numeric_limits<uint32_t>::max();
+}
+
 DLL_EXPORT bool magic_match(std::istream& f) {
     uint32_t magic = 0;
     f.read(reinterpret_cast<char*>(&magic), sizeof(magic));
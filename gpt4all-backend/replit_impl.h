@@ -22,8 +22,18 @@ public:
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
     size_t restoreState(const uint8_t *src) override;
+    size_t stateSizeFrom(int32_t n_from) const override;
+    size_t saveStateFrom(uint8_t *dest, int32_t n_from) const override;
+    size_t sequenceStateSize(int32_t seq_id, int32_t n_from) const override;
+    size_t saveSequenceState(int32_t seq_id, uint8_t *dest, int32_t n_from) const override;
+    size_t restoreSequenceState(int32_t seq_id, const uint8_t *src) override;
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
+    bool setSequenceCount(int32_t n_seq) override;
+    int32_t sequenceCount() const override;
+    size_t sequenceMemorySize() const override;
+    bool forkSequence(int32_t src, int32_t dst, int32_t n_tokens) override;
+    LLModel *newSession() const override;
 
 private:
     ReplitPrivate *d_ptr;
@@ -33,6 +43,9 @@ protected:
     std::string tokenToString(Token) const override;
     Token sampleToken(PromptContext &ctx) const override;
     bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
+    bool evalBatch(const std::vector<PromptContext*> &ctxs, const std::vector<Token> &tokens) const override;
+    bool evalTokensAll(PromptContext &ctx, const std::vector<int32_t> &tokens, std::vector<float> &logits) const override;
+    bool shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) override;
     int32_t contextLength() const override;
     const std::vector<Token>& endTokens() const override;
 };
@@ -0,0 +1,305 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// largest of the 16 floats starting at x
+static inline float gpt_max16(const float * x) {
+#if defined(__AVX__)
+    __m256 m = _mm256_max_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(x + 8));
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+    return _mm_cvtss_f32(h);
+#elif defined(__SSE2__)
+    __m128 h = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(x),     _mm_loadu_ps(x + 4)),
+                          _mm_max_ps(_mm_loadu_ps(x + 8), _mm_loadu_ps(x + 12)));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+    return _mm_cvtss_f32(h);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return vmaxvq_f32(vmaxq_f32(vmaxq_f32(vld1q_f32(x),     vld1q_f32(x + 4)),
+                                vmaxq_f32(vld1q_f32(x + 8), vld1q_f32(x + 12))));
+#else
+    float m = x[0];
+    for (int i = 1; i < 16; ++i) {
+        m = std::max(m, x[i]);
+    }
+    return m;
+#endif
+}
+
+static bool gpt_higher_logit(const gpt_sampler_candidate & a, const gpt_sampler_candidate & b) {
+    return a.logit > b.logit;
+}
+
+// find the k tokens with the highest logits with a min-heap of the best ones so far; blocks of logits
+// that can't beat the smallest of them are skipped after a single vectorized max
+static void gpt_select_top_k(gpt_sampler_state & s, size_t k) {
+    const float * logits = s.logits;
+    auto & candidates = s.buffers.candidates;
+    candidates.clear();
+    candidates.reserve(k);
+    float threshold = -INFINITY;
+    const auto consider = [&](size_t i) {
+        if (candidates.size() < k) {
+            candidates.push_back({ int32_t(i), logits[i], 0.0f });
+            std::push_heap(candidates.begin(), candidates.end(), gpt_higher_logit);
+        } else if (logits[i] > threshold) {
+            std::pop_heap(candidates.begin(), candidates.end(), gpt_higher_logit);
+            candidates.back() = { int32_t(i), logits[i], 0.0f };
+            std::push_heap(candidates.begin(), candidates.end(), gpt_higher_logit);
+        } else {
+            return;
+        }
+        if (candidates.size() == k)
+            threshold = candidates.front().logit;
+    };
+    size_t i = 0;
+    for (; i + 16 <= s.n_vocab; i += 16) {
+        if (candidates.size() == k && gpt_max16(logits + i) <= threshold)
+            continue;
+        for (size_t j = i; j < i + 16; ++j) {
+            consider(j);
+        }
+    }
+    for (; i < s.n_vocab; ++i) {
+        consider(i);
+    }
+
+    // highest logit first
+    std::sort_heap(candidates.begin(), candidates.end(), gpt_higher_logit);
+    s.n_candidates = candidates.size();
+}
+
+gpt_sampler_state::gpt_sampler_state(LLModel::PromptContext &ctx, float *logits, size_t n_vocab,
+                                     std::mt19937 &rng, gpt_sampler_buffers &buffers)
+    : ctx(ctx), logits(logits), n_vocab(n_vocab), rng(rng), buffers(buffers)
+{
+    buffers.touched.clear();
+    if (buffers.touched_pos.size() < n_vocab)
+        buffers.touched_pos.resize(n_vocab, 0);
+}
+
+gpt_sampler_state::~gpt_sampler_state()
+{
+    // the caller's logits are left as they were, and only the entries of the touched tokens are reset
+    for (const auto &t : buffers.touched) {
+        logits[t.id] = t.logit;
+        buffers.touched_pos[t.id] = 0;
+    }
+}
+
+float &gpt_sampler_state::touch(int32_t id)
+{
+    int32_t &pos = buffers.touched_pos[id];
+    if (!pos) {
+        buffers.touched.push_back({ id, logits[id], 0 });
+        pos = buffers.touched.size();
+    }
+    return logits[id];
+}
+
+namespace gpt_sampler {
+
+template <bool additive>
+void Penalties<additive>::apply(gpt_sampler_state &s) {
+    const auto &tokens = s.ctx.tokens;
+    const size_t n_last = std::min(size_t(std::max(s.ctx.repeat_last_n, 0)), tokens.size());
+    auto &touched = s.buffers.touched;
+    for (size_t i = tokens.size() - n_last; i < tokens.size(); ++i) {
+        const int32_t id = tokens[i];
+        if (id < 0 || size_t(id) >= s.n_vocab)
+            continue;
+        s.touch(id);
+        ++touched[s.buffers.touched_pos[id] - 1].count;
+    }
+
+    // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+    const float repeat_penalty = s.ctx.repeat_penalty;
+    for (const auto &t : touched) {
+        if (!t.count)
+            continue;
+        // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+        float l = t.logit < 0.0f ? t.logit*repeat_penalty : t.logit/repeat_penalty;
+        if constexpr (additive)
+            l -= s.ctx.presence_penalty + t.count*s.ctx.frequency_penalty;
+        s.logits[t.id] = l;
+    }
+}
+
+template struct Penalties<false>;
+template struct Penalties<true>;
+
+void LogitBias::apply(gpt_sampler_state &s) {
+    for (const auto &[id, bias] : s.ctx.logitBias) {
+        if (id >= 0 && size_t(id) < s.n_vocab)
+            s.touch(id) += bias;
+    }
+}
+
+void TopK::apply(gpt_sampler_state &s) {
+    const size_t k = s.ctx.top_k > 0 ? std::min(size_t(s.ctx.top_k), s.n_vocab) : s.n_vocab;
+    gpt_select_top_k(s, k);
+}
+
+void All::apply(gpt_sampler_state &s) {
+    gpt_select_top_k(s, s.n_vocab);
+}
+
+void Temperature::apply(gpt_sampler_state &s) {
+    auto &candidates = s.buffers.candidates;
+    const float scale = 1.0f/s.ctx.temp;
+    const float maxl = candidates.front().logit;
+    s.sum = 0.0f;
+    for (size_t i = 0; i < s.n_candidates; ++i) {
+        candidates[i].p = expf((candidates[i].logit - maxl)*scale);
+        s.sum += candidates[i].p;
+    }
+}
+
+void Typical::apply(gpt_sampler_state &s) {
+    // https://arxiv.org/abs/2202.00666
+    const float typical_p = s.ctx.typical_p;
+    if (typical_p >= 1.0f || s.n_candidates < 2)
+        return;
+
+    auto &candidates = s.buffers.candidates;
+    const auto begin = candidates.begin();
+    const auto end = candidates.begin() + s.n_candidates;
+    float entropy = 0.0f;
+    for (auto it = begin; it != end; ++it) {
+        const float p = it->p/s.sum;
+        entropy -= p*logf(p);
+    }
+
+    // keep the tokens whose surprise is closest to the entropy
+    const float sum = s.sum;
+    const auto distance = [entropy, sum](const gpt_sampler_candidate &c) {
+        return fabsf(-logf(c.p/sum) - entropy);
+    };
+    std::sort(begin, end, [&distance](const gpt_sampler_candidate &a, const gpt_sampler_candidate &b) {
+        return distance(a) < distance(b);
+    });
+    const float limit = typical_p*s.sum;
+    float cumsum = 0.0f;
+    size_t n_keep = s.n_candidates;
+    for (size_t i = 0; i < s.n_candidates; ++i) {
+        cumsum += candidates[i].p;
+        if (cumsum >= limit) {
+            n_keep = i + 1;
+            break;
+        }
+    }
+    s.n_candidates = n_keep;
+    s.sum = cumsum;
+    std::sort(begin, begin + n_keep, gpt_higher_logit);
+}
+
+void TopP::apply(gpt_sampler_state &s) {
+    // keep the smallest number of top tokens that make up top_p of the probability mass
+    if (s.ctx.top_p >= 1.0f)
+        return;
+    const auto &candidates = s.buffers.candidates;
+    const float limit = s.ctx.top_p*s.sum;
+    float cumsum = 0.0f;
+    for (size_t i = 0; i < s.n_candidates; ++i) {
+        cumsum += candidates[i].p;
+        if (cumsum >= limit) {
+            s.n_candidates = i + 1;
+            break;
+        }
+    }
+    s.sum = cumsum;
+}
+
+void MinP::apply(gpt_sampler_state &s) {
+    if (s.ctx.min_p <= 0.0f)
+        return;
+    const auto &candidates = s.buffers.candidates;
+    const float limit = s.ctx.min_p*candidates.front().p;
+    size_t n_keep = 1;
+    float sum = candidates.front().p;
+    while (n_keep < s.n_candidates && candidates[n_keep].p >= limit) {
+        sum += candidates[n_keep].p;
+        ++n_keep;
+    }
+    s.n_candidates = n_keep;
+    s.sum = sum;
+}
+
+void Greedy::apply(gpt_sampler_state &s) {
+    s.token = std::max_element(s.logits, s.logits + s.n_vocab) - s.logits;
+}
+
+void Draw::apply(gpt_sampler_state &s) {
+    // draw from the unnormalized probabilities of the remaining candidates
+    const auto &candidates = s.buffers.candidates;
+    float r = std::uniform_real_distribution<float>(0.0f, s.sum)(s.rng);
+    for (size_t i = 0; i < s.n_candidates; ++i) {
+        r -= candidates[i].p;
+        if (r < 0.0f) {
+            s.token = candidates[i].id;
+            return;
+        }
+    }
+    s.token = candidates[s.n_candidates - 1].id;
+}
+
+void Mirostat::apply(gpt_sampler_state &s) {
+    // https://arxiv.org/abs/2007.14966, the candidates must be complete and sorted
+    auto &ctx = s.ctx;
+    const auto &candidates = s.buffers.candidates;
+
+    // drop the tokens more surprising than mu, keeping at least one
+    size_t n_keep = 1;
+    float sum = candidates.front().p;
+    while (n_keep < s.n_candidates && -log2f(candidates[n_keep].p/s.sum) <= ctx.mirostat_mu) {
+        sum += candidates[n_keep].p;
+        ++n_keep;
+    }
+    s.n_candidates = n_keep;
+    s.sum = sum;
+    Draw::apply(s);
+
+    // move mu towards the target surprise
+    const auto it = std::find_if(candidates.begin(), candidates.begin() + n_keep,
+        [&s](const gpt_sampler_candidate &c) { return c.id == s.token; });
+    const float surprise = -log2f(it->p/s.sum);
+    ctx.mirostat_mu -= ctx.mirostat_eta*(surprise - ctx.mirostat_tau);
+}
+
+} // namespace gpt_sampler
+
+int32_t gpt_sample_token(
+        LLModel::PromptContext & ctx,
+        float * logits,
+        size_t n_vocab,
+        std::mt19937 & rng,
+        gpt_sampler_buffers & buffers) {
+    using namespace gpt_sampler;
+    gpt_sampler_state s(ctx, logits, n_vocab, rng, buffers);
+
+    const bool additive = ctx.presence_penalty != 0.0f || ctx.frequency_penalty != 0.0f;
+    if (ctx.temp <= 0) {
+        // select the token with the highest logit directly, after the same penalties as otherwise
+        if (additive)
+            return Chain<Penalties<true>, LogitBias, Greedy>::sample(s);
+        return Chain<Penalties<false>, LogitBias, Greedy>::sample(s);
+    }
+
+    if (ctx.mirostat)
+        return Chain<Penalties<true>, LogitBias, All, Temperature, Mirostat>::sample(s);
+
+    const bool defaults = !additive && ctx.logitBias.empty() && ctx.typical_p >= 1.0f && ctx.min_p <= 0.0f;
+    if (defaults)
+        return Chain<Penalties<false>, TopK, Temperature, TopP, Draw>::sample(s);
+
+    return Chain<Penalties<true>, LogitBias, TopK, Temperature, Typical, TopP, MinP, Draw>::sample(s);
+}
@@ -0,0 +1,96 @@
+// Token sampling shared by all implementations
+//
+// Sampling is a chain of stages that narrow down the candidates for the next token and finally draw
+// one of them. The stages of a chain are fixed at compile time, so the common configurations get a
+// specialised sampler without virtual dispatch or checks for stages they don't use.
+
+#pragma once
+
+#include "llmodel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+struct gpt_sampler_candidate {
+    int32_t id;
+    float logit;
+    float p;     // unnormalized probability, set by the temperature stage
+};
+
+// Buffers reused between calls of 'gpt_sample_token' so that sampling a token doesn't allocate.
+// Keep one per model.
+struct gpt_sampler_buffers {
+    struct Touched {
+        int32_t id;
+        float logit;   // original logit
+        int32_t count; // occurrences among the last repeat_last_n tokens
+    };
+    std::vector<gpt_sampler_candidate> candidates;
+    std::vector<Touched> touched;
+    std::vector<int32_t> touched_pos; // for every token of the vocabulary, 1 + its index in 'touched' or 0
+};
+
+// What the stages of a chain work on. The stages before the selection stage modify the logits in place;
+// they are restored when the state goes out of scope, so only the affected entries are ever written to.
+struct gpt_sampler_state {
+    gpt_sampler_state(LLModel::PromptContext &ctx, float *logits, size_t n_vocab, std::mt19937 &rng,
+                      gpt_sampler_buffers &buffers);
+    ~gpt_sampler_state();
+
+    // Logit of 'id' for modification; the original value is saved the first time
+    float &touch(int32_t id);
+
+    LLModel::PromptContext &ctx;
+    float *logits;
+    size_t n_vocab;
+    std::mt19937 &rng;
+    gpt_sampler_buffers &buffers;
+    size_t n_candidates = 0; // leading entries of buffers.candidates that are still in the running
+    float sum = 0.0f;        // sum of their probabilities
+    int32_t token = -1;      // the sampled token
+};
+
+namespace gpt_sampler {
+
+// Logit modifiers; Penalties applies the repetition penalty from the ctrl paper and, if 'additive',
+// the presence and frequency penalties as well
+template <bool additive>
+struct Penalties   { static void apply(gpt_sampler_state &s); };
+struct LogitBias   { static void apply(gpt_sampler_state &s); };
+
+// Selection of the candidates, highest logit first
+struct TopK        { static void apply(gpt_sampler_state &s); };
+struct All         { static void apply(gpt_sampler_state &s); };
+struct Temperature { static void apply(gpt_sampler_state &s); }; // probabilities of the candidates
+
+// Truncation by probability
+struct Typical     { static void apply(gpt_sampler_state &s); };
+struct TopP        { static void apply(gpt_sampler_state &s); };
+struct MinP        { static void apply(gpt_sampler_state &s); };
+
+// Final stages, which set the token
+struct Greedy      { static void apply(gpt_sampler_state &s); };
+struct Draw        { static void apply(gpt_sampler_state &s); };
+struct Mirostat    { static void apply(gpt_sampler_state &s); }; // mirostat 2.0
+
+template <typename... Stages>
+struct Chain {
+    static int32_t sample(gpt_sampler_state &s) {
+        (Stages::apply(s), ...);
+        return s.token;
+    }
+};
+
+} // namespace gpt_sampler
+
+// sample next token from the logits of the last evaluated token with the chain configured by the
+// sampling parameters of 'ctx'
+//
+int32_t gpt_sample_token(
+        LLModel::PromptContext &ctx,
+        float * logits,
+        size_t n_vocab,
+        std::mt19937 & rng,
+        gpt_sampler_buffers & buffers);
@@ -0,0 +1,102 @@
+#include "stopsequences.h"
+
+StopSequenceMatcher::StopSequenceMatcher(const std::vector<std::string> &patterns)
+{
+    // build the trie of the patterns, -1 marking missing transitions for now
+    Node root;
+    root.next.fill(-1);
+    m_nodes.push_back(root);
+    for (const std::string &pattern : patterns) {
+        if (pattern.empty())
+            continue;
+        int32_t node = 0;
+        for (const char ch : pattern) {
+            const unsigned char c = ch;
+            if (m_nodes[node].next[c] < 0) {
+                Node child;
+                child.next.fill(-1);
+                child.depth = m_nodes[node].depth + 1;
+                m_nodes[node].next[c] = m_nodes.size();
+                m_nodes.push_back(child);
+            }
+            node = m_nodes[node].next[c];
+        }
+        m_nodes[node].match = pattern.size();
+    }
+
+    // Complete the transition table in breadth first order: a missing transition continues from the
+    // node of the longest proper suffix that is also a pattern prefix, which is already complete
+    std::vector<int32_t> fail(m_nodes.size(), 0);
+    std::vector<int32_t> queue;
+    queue.reserve(m_nodes.size());
+    for (int c = 0; c < 256; ++c) {
+        int32_t &child = m_nodes[0].next[c];
+        if (child < 0) {
+            child = 0;
+        } else {
+            fail[child] = 0;
+            queue.push_back(child);
+        }
+    }
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const int32_t node = queue[i];
+        if (!m_nodes[node].match)
+            m_nodes[node].match = m_nodes[fail[node]].match;
+        for (int c = 0; c < 256; ++c) {
+            int32_t &child = m_nodes[node].next[c];
+            if (child < 0) {
+                child = m_nodes[fail[node]].next[c];
+            } else {
+                fail[child] = m_nodes[fail[node]].next[c];
+                queue.push_back(child);
+            }
+        }
+    }
+}
+
+bool StopSequenceFilter::push(int32_t token, const std::string &text)
+{
+    if (m_stopped)
+        return true;
+
+    m_held.push_back({ token, text });
+    for (size_t i = 0; i < text.size(); ++i) {
+        const size_t n_match = m_matcher.feed(text[i]);
+        if (n_match) {
+            // everything from the first byte of the stop sequence on is dropped
+            m_heldBytes += text.size();
+            truncate(m_heldBytes - text.size() + i + 1 - n_match);
+            m_stopped = true;
+            return true;
+        }
+    }
+    m_heldBytes += text.size();
+    return false;
+}
+
+void StopSequenceFilter::release(std::vector<Piece> &out, bool all)
+{
+    size_t n_final = all || m_stopped ? m_heldBytes : m_heldBytes - m_matcher.pending();
+    while (!m_held.empty() && m_held.front().text.size() <= n_final) {
+        n_final -= m_held.front().text.size();
+        m_heldBytes -= m_held.front().text.size();
+        out.push_back(std::move(m_held.front()));
+        m_held.pop_front();
+    }
+}
+
+void StopSequenceFilter::truncate(size_t n_bytes)
+{
+    size_t offset = 0;
+    for (size_t i = 0; i < m_held.size(); ++i) {
+        if (offset + m_held[i].text.size() < n_bytes) {
+            offset += m_held[i].text.size();
+            continue;
+        }
+        // this token reaches into the stop sequence, keep only what is in front of it
+        m_held[i].text.resize(n_bytes - offset);
+        m_held.resize(m_held[i].text.empty() ? i : i + 1);
+        break;
+    }
+    m_heldBytes = n_bytes;
+}
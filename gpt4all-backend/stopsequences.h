@@ -0,0 +1,68 @@
+#ifndef STOPSEQUENCES_H
+#define STOPSEQUENCES_H
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Finds any of a set of strings in a stream of bytes. The strings are compiled into an Aho-Corasick
+// automaton with a complete transition table once, after which every byte costs a single lookup.
+class StopSequenceMatcher {
+public:
+    explicit StopSequenceMatcher(const std::vector<std::string> &patterns = {});
+
+    void reset() { m_state = 0; }
+
+    // Consumes one byte and returns the length of the longest pattern ending with it; 0 if none does
+    size_t feed(unsigned char c) {
+        m_state = m_nodes[m_state].next[c];
+        return m_nodes[m_state].match;
+    }
+
+    // Number of most recent bytes that begin some pattern and could still complete it
+    size_t pending() const { return m_nodes[m_state].depth; }
+
+private:
+    struct Node {
+        std::array<int32_t, 256> next;
+        uint32_t depth = 0;  // length of the pattern prefix this node stands for
+        uint32_t match = 0;  // length of the longest pattern that is a suffix of it
+    };
+
+    std::vector<Node> m_nodes;
+    int32_t m_state = 0;
+};
+
+// Holds back the generated tokens for as long as their text could still turn out to be the beginning
+// of a stop sequence. Once a stop sequence is found the response is cut off right before it.
+class StopSequenceFilter {
+public:
+    struct Piece {
+        int32_t token;
+        std::string text;
+    };
+
+    explicit StopSequenceFilter(const std::vector<std::string> &stopSequences = {})
+        : m_matcher(stopSequences) {}
+
+    // Appends the next token; returns true if its text completes a stop sequence
+    bool push(int32_t token, const std::string &text);
+
+    // Moves the tokens whose text is certainly part of the response into 'out'; with 'all' everything
+    // held back is released, e.g. because the generation ends
+    void release(std::vector<Piece> &out, bool all = false);
+
+    bool stopped() const { return m_stopped; }
+
+private:
+    void truncate(size_t n_bytes);
+
+    StopSequenceMatcher m_matcher;
+    std::deque<Piece> m_held;
+    size_t m_heldBytes = 0;
+    bool m_stopped = false;
+};
+
+#endif // STOPSEQUENCES_H
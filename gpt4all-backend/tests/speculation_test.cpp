@@ -0,0 +1,131 @@
+// Speculative decoding must not change what gets sampled: with the same seed, the shared prompt loop has
+// to produce exactly the same tokens with a draft model or prompt lookup as without either of them.
+//
+// The model is a fake whose logits only depend on the last two tokens of its kv cache, which makes the
+// output repetitive enough for prompt lookup to guess right some of the time and wrong the rest. The
+// draft model is another one with different logits.
+
+#include "../llmodel.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+class FakeModel : public LLModel {
+public:
+    explicit FakeModel(uint32_t salt) : m_salt(salt) {}
+
+    bool loadModel(const std::string &/*modelPath*/) override { return true; }
+    bool isModelLoaded() const override { return true; }
+
+    void seed(uint32_t seed) { m_rng.seed(seed); m_kv.clear(); }
+    int verifications() const { return m_verifications; }
+
+protected:
+    std::vector<Token> tokenize(PromptContext &, const std::string &str) const override {
+        std::vector<Token> tokens;
+        for (const unsigned char c : str)
+            tokens.push_back(c % n_vocab);
+        return tokens;
+    }
+
+    std::string tokenToString(Token id) const override {
+        return std::string(1, char('a' + id));
+    }
+
+    // sampling at the temperature of the context, with a repeat penalty so that it also depends on the
+    // tokens of the context
+    Token sampleToken(PromptContext &ctx) const override {
+        std::vector<float> logits = ctx.logits;
+        const size_t n_last = std::min(ctx.tokens.size(), size_t(ctx.repeat_last_n));
+        for (size_t i = ctx.tokens.size() - n_last; i < ctx.tokens.size(); ++i)
+            logits[ctx.tokens[i]] /= ctx.repeat_penalty;
+        std::vector<double> probs;
+        for (const float logit : logits)
+            probs.push_back(std::exp(logit / ctx.temp));
+        std::discrete_distribution<Token> dist(probs.begin(), probs.end());
+        return dist(m_rng);
+    }
+
+    bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override {
+        // like a kv cache, everything past n_past gets overwritten
+        m_kv.resize(ctx.n_past);
+        m_kv.insert(m_kv.end(), tokens.begin(), tokens.end());
+        const uint32_t a = m_kv.size() > 1 ? m_kv[m_kv.size() - 2] : 0;
+        const uint32_t b = m_kv.back();
+        ctx.logits.resize(n_vocab);
+        for (uint32_t v = 0; v < n_vocab; ++v) {
+            uint32_t h = (a * 2654435761u) ^ (b * 40503u) ^ (v * 2246822519u) ^ m_salt;
+            h ^= h >> 15; h *= 2246822519u; h ^= h >> 13;
+            ctx.logits[v] = 6.0f * float(h & 0xffff) / 65535.0f;
+        }
+        return true;
+    }
+
+    bool evalTokensAll(PromptContext &ctx, const std::vector<int32_t> &tokens, std::vector<float> &logits) const override {
+        ++m_verifications;
+        return LLModel::evalTokensAll(ctx, tokens, logits);
+    }
+
+    int32_t contextLength() const override { return 512; }
+    const std::vector<Token> &endTokens() const override { return m_endTokens; }
+
+private:
+    static constexpr uint32_t n_vocab = 8;
+    uint32_t m_salt;
+    mutable std::mt19937 m_rng;
+    mutable std::vector<Token> m_kv;
+    mutable int m_verifications = 0;
+    std::vector<Token> m_endTokens;
+};
+
+static std::vector<int32_t> generate(FakeModel &model, uint32_t seed) {
+    model.seed(seed);
+    LLModel::PromptContext ctx;
+    ctx.n_predict = 300;
+    ctx.temp = 0.8f;
+    ctx.repeat_last_n = 8;
+    std::vector<int32_t> tokens;
+    model.prompt("abcabcabc", [](int32_t) { return true; },
+        [&tokens](int32_t token, const std::string &) { tokens.push_back(token); return true; },
+        [](bool) { return true; }, ctx);
+    return tokens;
+}
+
+static bool check(const char *name, const std::vector<int32_t> &expected, const std::vector<int32_t> &actual,
+                  int verifications) {
+    if (actual != expected) {
+        size_t i = 0;
+        while (i < expected.size() && i < actual.size() && expected[i] == actual[i])
+            ++i;
+        fprintf(stderr, "%s: output differs from ordinary sampling at token %zu of %zu\n", name, i, expected.size());
+        return false;
+    }
+    if (!verifications) {
+        fprintf(stderr, "%s: nothing was speculated\n", name);
+        return false;
+    }
+    fprintf(stderr, "%s: %zu tokens as without speculation, %d verifications\n", name, actual.size(), verifications);
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    for (const uint32_t seed : { 1u, 42u, 1234u }) {
+        FakeModel model(0);
+        const std::vector<int32_t> expected = generate(model, seed);
+
+        FakeModel lookup(0);
+        lookup.setPromptLookup(4, 2);
+        const std::vector<int32_t> looked = generate(lookup, seed);
+        ok &= check("prompt lookup", expected, looked, lookup.verifications());
+
+        FakeModel target(0), draft(7);
+        target.setDraftModel(&draft, 4);
+        const std::vector<int32_t> drafted = generate(target, seed);
+        ok &= check("draft model", expected, drafted, target.verifications());
+    }
+    return ok ? 0 : 1;
+}
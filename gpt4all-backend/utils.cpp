@@ -1,7 +1,26 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <regex>
+#include <sstream>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
@@ -217,112 +236,422 @@ bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     return true;
 }
 
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const size_t actualVocabSize,
-        const int32_t * last_n_tokens_data,
-        int   last_n_tokens_size,
-        const std::vector<float> logits,
-        int    top_k,
-        double top_p,
-        double temp,
-        float repeat_penalty,
-        std::mt19937 & rng) {
-    int n_logits = actualVocabSize;
-
-    const auto last_n_tokens = std::vector<int32_t>(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
-    const auto * plogits = logits.data();
-
-    if (temp <= 0) {
-        // select the token with the highest logit directly
-        float max_logit = plogits[0];
-        gpt_vocab::id max_id = 0;
-
-        for (int i = 1; i < n_logits; ++i) {
-            if (plogits[i] > max_logit) {
-                max_logit = plogits[i];
-                max_id = i;
-            }
-        }
-        return max_id;
+bool gpt_mmap::open(const std::string & fname) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    // the view keeps the mapping alive
+    addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!addr)
+        return false;
+    size = file_size.QuadPart;
+#else
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
     }
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    // the mapping keeps the file open
+    void * ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return false;
+    addr = ptr;
+    size = st.st_size;
+#endif
+    return true;
+}
 
-    {
-        const float scale = 1.0f/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
-                }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+gpt_mmap::~gpt_mmap() {
+    if (!addr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
+
+bool gpt_read_ranges(const std::string & fname, const gpt_mmap & mapping, const std::vector<gpt_file_range> & ranges) {
+    // split the ranges into pieces so that the big tensors are spread over the threads as well
+    constexpr size_t piece_size = 16_MiB;
+    std::vector<gpt_file_range> pieces;
+    for (const auto & range : ranges) {
+        for (size_t done = 0; done < range.size; done += piece_size) {
+            pieces.push_back({ range.offset + done, std::min(piece_size, range.size - done), (char *) range.dst + done });
+        }
+    }
+    if (pieces.empty())
+        return true;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    if (!mapping.addr) {
+        file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+    }
+    const auto read_piece = [file](const gpt_file_range & piece) {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(piece.offset);
+        overlapped.OffsetHigh = DWORD(uint64_t(piece.offset) >> 32);
+        DWORD n_read = 0;
+        return ReadFile(file, piece.dst, DWORD(piece.size), &n_read, &overlapped) && n_read == piece.size;
+    };
+#else
+    int fd = -1;
+    if (!mapping.addr) {
+        fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+    }
+    const auto read_piece = [fd](const gpt_file_range & piece) {
+        size_t done = 0;
+        while (done < piece.size) {
+            const ssize_t n_read = pread(fd, (char *) piece.dst + done, piece.size - done, piece.offset + done);
+            if (n_read <= 0)
+                return false;
+            done += n_read;
+        }
+        return true;
+    };
+#endif
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    const auto worker = [&]() {
+        for (size_t i = next++; i < pieces.size() && ok; i = next++) {
+            const auto & piece = pieces[i];
+            if (mapping.addr) {
+                if (piece.offset + piece.size > mapping.size)
+                    ok = false;
+                else
+                    memcpy(piece.dst, (const char *) mapping.addr + piece.offset, piece.size);
+            } else if (!read_piece(piece)) {
+                ok = false;
             }
         }
+    };
+
+    // storage rather than compute bound, a few threads are enough to keep it busy
+    const size_t n_threads = std::min<size_t>(std::clamp(std::thread::hardware_concurrency(), 1u, 8u), pieces.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & thread : threads) {
+        thread.join();
     }
 
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
-        return a.first > b.first;
-    });
+#ifdef _WIN32
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+#else
+    if (fd >= 0)
+        close(fd);
+#endif
+    return ok;
+}
 
-    logits_id.resize(top_k);
+size_t gpt_rng_save(const std::mt19937 & rng, uint32_t * words) {
+    std::stringstream ss;
+    ss << rng;
+    size_t n_words = 0;
+    uint64_t word;
+    while (n_words < GPT_RNG_STATE_WORDS && ss >> word) {
+        words[n_words++] = uint32_t(word);
+    }
+    return n_words;
+}
 
-    double maxl = -INFINITY;
-    for (const auto & kv : logits_id) {
-        maxl = std::max(maxl, kv.first);
+bool gpt_rng_load(std::mt19937 & rng, const uint32_t * words, size_t n_words) {
+    std::stringstream ss;
+    for (size_t i = 0; i < n_words; ++i) {
+        ss << (i ? " " : "") << words[i];
     }
+    ss >> rng;
+    return !ss.fail();
+}
 
-    // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+void gpt_scratch::use(ggml_context * ctx, int i) {
+    const size_t used = ggml_set_scratch(ctx, i < 0 ? ggml_scratch{ 0, 0, nullptr } : buf[i]);
+    if (current >= 0)
+        peak[current] = std::max(peak[current], used);
+    current = i;
+}
 
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        double p = exp(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
+size_t gpt_row_size(ggml_type type, int64_t n) {
+    return ggml_type_size(type)*n/ggml_blck_size(type);
+}
+
+ggml_type gpt_kv_type(LLModel::LoadOptions::KVType type) {
+    switch (type) {
+    case LLModel::LoadOptions::KVType::Q8_0: return GGML_TYPE_Q8_0;
+    case LLModel::LoadOptions::KVType::Q4_0: return GGML_TYPE_Q4_0;
+    default:                                 return GGML_TYPE_F16;
     }
+}
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+size_t gpt_graph_work_size(const ggml_cgraph & gf, int n_threads) {
+    size_t work = 0;
+    for (int i = 0; i < gf.n_nodes; ++i) {
+        const ggml_tensor * node = gf.nodes[i];
+        if (node->op != GGML_OP_MUL_MAT || node->src0->type == GGML_TYPE_F32)
+            continue;
+        // src1 converted to the type src0 is multiplied with, which is never larger than floats
+        size_t cur = sizeof(float)*ggml_nelements(node->src1);
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        // or src0 converted to floats for blas
+        cur = std::max(cur, sizeof(float)*size_t(node->src0->ne[0]*node->src0->ne[1]));
+#endif
+        work = std::max(work, cur);
     }
+    // a cache line of padding per thread and the tensor around the buffer
+    return work + 64*size_t(n_threads) + 1024;
+}
 
-    if (top_p < 1.0f) {
-        double cumsum = 0.0f;
-        for (int i = 0; i < top_k; i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                top_k = i + 1;
-                probs.resize(top_k);
-                logits_id.resize(top_k);
-                break;
+int gpt_decode_n_kv(int n_past, int n_tokens, int n_ctx) {
+    const int n = n_past + n_tokens;
+    return std::min(n_ctx, (n + GPT_DECODE_KV_STEP - 1)/GPT_DECODE_KV_STEP*GPT_DECODE_KV_STEP);
+}
+
+void gpt_kv_pages::init(int n_pages, int n_seq) {
+    refs.assign(n_pages, 0);
+    tables.assign(n_seq, {});
+    reset();
+}
+
+void gpt_kv_pages::grow(int n_pages) {
+    const int n_old = this->n_pages();
+    if (n_pages <= n_old)
+        return;
+    refs.resize(n_pages, 0);
+    // the new pages are handed out after the ones that were unused already
+    free.insert(free.begin(), n_pages - n_old, 0);
+    for (int i = 0; i < n_pages - n_old; ++i) {
+        free[i] = n_pages - 1 - i;
+    }
+}
+
+void gpt_kv_pages::spans(int seq, int n, std::vector<gpt_kv_span> & out) const {
+    const auto & table = tables[seq];
+    const size_t first = out.size();
+    for (int pos = 0; pos < n; pos += GPT_KV_PAGE) {
+        const size_t page = pos/GPT_KV_PAGE;
+        const int n_run = std::min(GPT_KV_PAGE, n - pos);
+        int row = 0;
+        if (page < table.size()) {
+            row = table[page]*GPT_KV_PAGE;
+        } else if (out.size() > first && out.back().row + out.back().n + n_run <= n_pages()*GPT_KV_PAGE) {
+            // masked, any rows do
+            row = out.back().row + out.back().n;
+        }
+        if (out.size() > first && out.back().row + out.back().n == row) {
+            out.back().n += n_run;
+        } else {
+            out.push_back({ pos, row, n_run });
+        }
+    }
+}
+
+int gpt_kv_pages::missing(int seq, int n_from, int n_to) const {
+    const auto & table = tables[seq];
+    int n = 0;
+    for (int page = std::min<int>(n_from/GPT_KV_PAGE, table.size()); page*GPT_KV_PAGE < n_to; ++page) {
+        n += page >= int(table.size()) || refs[table[page]] > 1;
+    }
+    return n;
+}
+
+void gpt_kv_pages::prepare(int seq, int n_from, int n_to, std::vector<std::pair<int, int>> & copies) {
+    auto & table = tables[seq];
+    for (int page = std::min<int>(n_from/GPT_KV_PAGE, table.size()); page*GPT_KV_PAGE < n_to; ++page) {
+        if (page < int(table.size()) && refs[table[page]] == 1)
+            continue;
+        const int fresh = take(page > 0 ? table[page - 1] : -1);
+        if (page < int(table.size())) {
+            copies.emplace_back(table[page], fresh);
+            --refs[table[page]];
+            table[page] = fresh;
+        } else {
+            table.push_back(fresh);
+        }
+    }
+}
+
+int gpt_kv_pages::take(int after) {
+    assert(!free.empty());
+    int page = after + 1;
+    if (after < 0 || page >= n_pages() || refs[page]) {
+        // the longest run of unused pages, from its middle to leave room for a sequence in front of it
+        int begin = 0, n = 0;
+        for (int i = 0, j; i < n_pages(); i = j + 1) {
+            for (j = i; j < n_pages() && !refs[j]; ++j);
+            if (j - i > n) {
+                begin = i;
+                n = j - i;
             }
         }
+        page = begin == 0 ? 0 : begin + n/2;
+    }
+    free.erase(std::find(free.begin(), free.end(), page));
+    refs[page] = 1;
+    return page;
+}
+
+void gpt_kv_pages::truncate(int seq, int n_tokens) {
+    auto & table = tables[seq];
+    const size_t n_keep = (std::max(n_tokens, 0) + GPT_KV_PAGE - 1)/GPT_KV_PAGE;
+    while (table.size() > n_keep) {
+        if (--refs[table.back()] == 0)
+            free.push_back(table.back());
+        table.pop_back();
+    }
+}
+
+void gpt_kv_pages::fork(int src, int dst, int n_tokens) {
+    if (src == dst)
+        return truncate(dst, n_tokens);
+    truncate(dst, 0);
+    const auto & from = tables[src];
+    const size_t n_share = std::min<size_t>((std::max(n_tokens, 0) + GPT_KV_PAGE - 1)/GPT_KV_PAGE, from.size());
+    for (size_t i = 0; i < n_share; ++i) {
+        ++refs[from[i]];
+        tables[dst].push_back(from[i]);
+    }
+}
 
-        cumsum = 1.0/cumsum;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            probs[i] *= cumsum;
+void gpt_kv_pages::reset() {
+    for (auto & table : tables) {
+        table.clear();
+    }
+    std::fill(refs.begin(), refs.end(), 0);
+    free.resize(refs.size());
+    for (size_t i = 0; i < free.size(); ++i) {
+        free[i] = int(free.size() - 1 - i);
+    }
+}
+
+std::vector<int> gpt_kv_pages::layout() const {
+    int n_used = 0;
+    for (const auto & table : tables) {
+        n_used += !table.empty();
+    }
+    const int room = n_used ? n_free()/n_used : 0;
+
+    std::vector<int> to(refs.size(), -1);
+    int next = 0;
+    for (const auto & table : tables) {
+        if (table.empty())
+            continue;
+        for (const int page : table) {
+            if (to[page] < 0)
+                to[page] = next++;
         }
+        next += room;
     }
+    return to;
+}
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs.size(); i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //exit(0);
+void gpt_kv_pages::move(const std::vector<int> & to) {
+    for (auto & table : tables) {
+        for (int & page : table) {
+            page = to[page];
+        }
+    }
+    std::vector<int> moved(refs.size(), 0);
+    for (size_t i = 0; i < refs.size(); ++i) {
+        if (refs[i])
+            moved[to[i]] = refs[i];
+    }
+    refs = std::move(moved);
+    free.clear();
+    for (int i = n_pages() - 1; i >= 0; --i) {
+        if (!refs[i])
+            free.push_back(i);
+    }
+}
+
+int gpt_kv_pages_for(int n_tokens, int n_seq) {
+    return n_seq*((std::max(n_tokens, 1) + GPT_KV_PAGE - 1)/GPT_KV_PAGE);
+}
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+void gpt_decode_graph::reset() {
+    if (ctx)
+        ggml_free(ctx);
+    ctx = nullptr;
+    gf.reset();
+    embd = nullptr;
+    logits = nullptr;
+    seq_ids.clear();
+    n_kv.clear();
+    spans.clear();
+    n_threads = 0;
+    rows.clear();
+    params.clear();
+    leaves.clear();
+}
+
+bool gpt_decode_graph::matches(const std::vector<int> & seq_ids, const std::vector<int> & n_kv, int n_threads,
+                               const std::vector<gpt_kv_span> & spans) const {
+    return ctx && !this->seq_ids.empty() && this->seq_ids == seq_ids && this->n_kv == n_kv
+        && this->n_threads == n_threads && this->spans == spans;
+}
 
-    return logits_id[idx].second;
-}
\ No newline at end of file
+void gpt_decode_graph::keep(const gpt_scratch & scratch, std::vector<int> seq_ids, std::vector<int> n_kv,
+                            int n_threads, std::vector<gpt_kv_span> spans) {
+    for (int i = 0; i < gf->n_leafs; ++i) {
+        ggml_tensor * leaf = gf->leafs[i];
+        for (const auto & buf : scratch.buf) {
+            const char * data = (const char *) leaf->data;
+            if (buf.data && data >= (const char *) buf.data && data < (const char *) buf.data + buf.size) {
+                leaves.emplace_back(leaf, std::vector<uint8_t>(data, data + ggml_nbytes(leaf)));
+                break;
+            }
+        }
+    }
+    this->seq_ids = std::move(seq_ids);
+    this->n_kv = std::move(n_kv);
+    this->n_threads = n_threads;
+    this->spans = std::move(spans);
+}
+
+void gpt_decode_graph::patch(const std::vector<int> & n_past, const gpt_kv_pages & pages) {
+    for (auto & [leaf, data] : leaves) {
+        memcpy(leaf->data, data.data(), data.size());
+    }
+    for (const auto & row : rows) {
+        row.t->data = row.base + pages.row(seq_ids[row.seq], n_past[row.seq])*row.stride;
+    }
+    for (const auto & param : params) {
+        ((int32_t *) param.t->data)[0] = n_past[param.seq];
+    }
+}
+
+void gpt_alibi_table(float * table, int n_ctx, int n_head, float bias_max) {
+    const int n_heads_log2_floor = 1 << int(floor(log2(n_head)));
+    const float m0 = powf(2.0f, -bias_max/n_heads_log2_floor);
+    const float m1 = powf(2.0f, -bias_max/2.0f/n_heads_log2_floor);
+
+    for (int h = 0; h < n_head; ++h) {
+        const float slope = h < n_heads_log2_floor ? powf(m0, h + 1) : powf(m1, 2*(h - n_heads_log2_floor) + 1);
+        for (int i = 0; i < n_ctx; ++i) {
+            table[size_t(h)*n_ctx + i] = i*slope;
+        }
+    }
+}
@@ -7,6 +7,11 @@
 #include <vector>
 #include <random>
 #include <thread>
+#include <memory>
+
+#include <ggml.h>
+
+#include "llmodel.h"
 
 //
 // General purpose inline functions
@@ -78,20 +83,227 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::stri
 // load the tokens from encoder.json
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
 
-// sample next token given probabilities for each embedding
 //
-//   - consider only the top K tokens
-//   - from them, consider only the top tokens with cumulative probability > P
+// Model files
+//
+
+// Read-only mapping of a whole file into memory; 'addr' stays null if the file can't be mapped, in
+// which case the caller reads it instead
+struct gpt_mmap {
+    gpt_mmap() = default;
+    gpt_mmap(const gpt_mmap &) = delete;
+    gpt_mmap & operator=(const gpt_mmap &) = delete;
+    ~gpt_mmap();
+
+    bool open(const std::string & fname);
+
+    void * addr = nullptr;
+    size_t size = 0;
+};
+
+// weights are used from the mapping directly if they are aligned like this in the file
+constexpr size_t GPT_MMAP_ALIGN = 4;
+
+// a range of a model file that has to be copied to memory
+struct gpt_file_range {
+    size_t offset;
+    size_t size;
+    void * dst;
+};
+
+// copy the ranges of a model file to memory with a few threads, from the mapping if the file is mapped
+// and with positional reads otherwise
+bool gpt_read_ranges(const std::string & fname, const gpt_mmap & mapping, const std::vector<gpt_file_range> & ranges);
+
 //
-// TODO: not sure if this implementation is correct
+// Session state
 //
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const size_t actualVocabSize,
-        const int32_t * last_n_tokens_data,
-        int   last_n_tokens_size,
-        const std::vector<float> logits,
-        int    top_k,
-        double top_p,
-        double temp,
-        float repeat_penalty,
-        std::mt19937 & rng);
+
+// tag at the start of a compact state with the kv cache in its paged layout; states of other formats,
+// whole kv caches that start with the length of the rng as text or compact states tagged gst1 with the
+// layout before, can't be restored
+constexpr uint32_t GPT_STATE_MAGIC = 0x67737432; // gst2
+
+// room for the words of the rng in a state, the generator's own state plus the position some
+// implementations of the standard library write along with it
+constexpr size_t GPT_RNG_STATE_WORDS = std::mt19937::state_size + 1;
+
+// the rng as the numbers of its textual representation, at most GPT_RNG_STATE_WORDS of them; returns how
+// many were written to 'words'
+size_t gpt_rng_save(const std::mt19937 & rng, uint32_t * words);
+
+bool gpt_rng_load(std::mt19937 & rng, const uint32_t * words, size_t n_words);
+
+//
+// Graph evaluation
+//
+
+// Switches a graph being built between two scratch buffers, which the intermediate tensors of a layer
+// go to instead of the memory of the graph's context. Whatever a layer leaves in one of them is dead by
+// the time the next layer is built into it, so all layers share the same memory. The peak use of each
+// buffer is recorded, which is what a plan reserves for it.
+struct gpt_scratch {
+    ggml_scratch buf[2] = {};
+    size_t peak[2] = {};
+    int current = -1;
+
+    // switch to buffer 'i', or back to the memory of the context with -1
+    void use(ggml_context * ctx, int i);
+};
+
+// bytes that 'n' values of 'type' take in a row, for quantized types a multiple of their block size
+size_t gpt_row_size(ggml_type type, int64_t n);
+
+// type of the keys in the kv cache for the load option
+ggml_type gpt_kv_type(LLModel::LoadOptions::KVType type);
+
+// upper bound of the work buffer ggml_graph_compute takes from the context of 'gf'
+size_t gpt_graph_work_size(const ggml_cgraph & gf, int n_threads);
+
+// the rows of the kv cache a decoding step attends to are rounded up to a multiple of this, so that
+// the graph of one step serves the following ones; the rows past the sequence are masked
+constexpr int GPT_DECODE_KV_STEP = 256;
+
+int gpt_decode_n_kv(int n_past, int n_tokens, int n_ctx);
+
+// tokens in a page of the kv cache
+constexpr int GPT_KV_PAGE = 128;
+
+// the kv cache is allocated for as many tokens as the sequences use, growing by this many of every
+// sequence at a time
+constexpr int GPT_KV_CHUNK = 2*GPT_DECODE_KV_STEP;
+
+// positions [pos, pos + n) of a sequence, which are in the consecutive rows [row, row + n) of the kv cache
+struct gpt_kv_span {
+    int pos;
+    int row;
+    int n;
+
+    bool operator==(const gpt_kv_span &) const = default;
+};
+
+// attention reads the keys and values of a sequence through a view of every span of it; a sequence
+// spread over more spans than this gets its pages moved together
+constexpr int GPT_KV_MAX_SPANS = 4;
+
+// The kv cache holds the keys and values of the tokens in pages of GPT_KV_PAGE rows, taken from a pool
+// as the sequences need them; the table of a sequence lists the pages of its tokens in order. A sequence
+// forked from another shares its pages, and gets a copy of a shared page of its own only once it writes
+// to it. A sequence gets the page following its last one if that is unused, so that its tokens stay in
+// few spans.
+struct gpt_kv_pages {
+    std::vector<int> refs;                // number of sequences using every page of the pool
+    std::vector<int> free;                // the unused pages
+    std::vector<std::vector<int>> tables; // pages of every sequence
+
+    void init(int n_pages, int n_seq);
+    int n_pages() const { return int(refs.size()); }
+    int n_free() const { return int(free.size()); }
+
+    // add unused pages to the pool, up to 'n_pages' of them
+    void grow(int n_pages);
+
+    // row of the pool holding the token at 'pos' of 'seq', row 0 if it has no page there yet; rows
+    // that aren't written yet hold zeroes or what was written to them before, never nan
+    int row(int seq, int pos) const {
+        const auto & table = tables[seq];
+        const size_t page = pos/GPT_KV_PAGE;
+        return page < table.size() ? table[page]*GPT_KV_PAGE + pos%GPT_KV_PAGE : 0;
+    }
+
+    // number of tokens from 'pos' on that are in the same page and so in consecutive rows, at most 'n'
+    int run(int pos, int n) const { return std::min(n, GPT_KV_PAGE - pos%GPT_KV_PAGE); }
+
+    // append the spans of the positions [0, n) of 'seq' to 'out'; positions past its pages continue its
+    // last span as far as the pool goes
+    void spans(int seq, int n, std::vector<gpt_kv_span> & out) const;
+
+    // pages 'prepare' takes from the unused ones for the tokens [n_from, n_to) of 'seq'
+    int missing(int seq, int n_from, int n_to) const;
+
+    // let 'seq' write its tokens [n_from, n_to): the pages it doesn't have yet are taken from the unused
+    // ones, and pages it shares are replaced by pages of its own, which need the contents of the shared
+    // ones copied into them; those are appended to 'copies' as (from, to) pairs. There must be at least
+    // 'missing' unused pages
+    void prepare(int seq, int n_from, int n_to, std::vector<std::pair<int, int>> & copies);
+
+    // give up the pages of 'seq' past its first 'n_tokens' tokens
+    void truncate(int seq, int n_tokens);
+
+    // let 'dst' continue from the first 'n_tokens' tokens of 'src', sharing their pages
+    void fork(int src, int dst, int n_tokens);
+
+    // give up all pages, which are then handed out in order again
+    void reset();
+
+    // where every page goes, or -1 if unused, with the pages of each sequence one after the other
+    // and the unused ones spread between the sequences for them to grow into; a shared page goes with
+    // the first sequence using it
+    std::vector<int> layout() const;
+
+    // move the pages to where 'to' says, after their contents were
+    void move(const std::vector<int> & to);
+
+private:
+    // take the page following 'after' if it is unused, otherwise one in the longest run of unused pages
+    int take(int after);
+};
+
+// pages of the kv cache that 'n_seq' sequences of up to 'n_tokens' tokens take at most
+int gpt_kv_pages_for(int n_tokens, int n_seq);
+
+// The graph of the last decoding step, kept to evaluate the following steps of the same sequences
+// with. Only the positions of the sequences change between them: the rows of the kv cache the new
+// tokens are stored in and the positions handed to operators as parameters, which are patched in place
+// of building the graph again. The spans of the kv cache they attend to have to stay the same.
+struct gpt_decode_graph {
+    struct ggml_context * ctx = nullptr;
+    std::unique_ptr<ggml_cgraph> gf;
+    ggml_tensor * embd = nullptr;
+    ggml_tensor * logits = nullptr;
+
+    // what the graph was built for: the sequences, the rows they attend to and the number of threads
+    std::vector<int> seq_ids;
+    std::vector<int> n_kv;
+    std::vector<gpt_kv_span> spans;
+    int n_threads = 0;
+
+    // tensors at the row of the kv cache holding the position of a sequence of the batch
+    struct Row {
+        ggml_tensor * t;
+        int seq;
+        char * base;
+        size_t stride;
+    };
+    std::vector<Row> rows;
+
+    // operator parameters starting with the position of a sequence of the batch
+    struct Param {
+        ggml_tensor * t;
+        int seq;
+    };
+    std::vector<Param> params;
+
+    // contents of the leaves in the scratch buffers, which are overwritten while computing the graph
+    std::vector<std::pair<ggml_tensor *, std::vector<uint8_t>>> leaves;
+
+    ~gpt_decode_graph() { reset(); }
+
+    void reset();
+
+    // 'spans' are those of all sequences one after the other
+    bool matches(const std::vector<int> & seq_ids, const std::vector<int> & n_kv, int n_threads,
+                 const std::vector<gpt_kv_span> & spans) const;
+
+    // keep the graph just built for later steps
+    void keep(const gpt_scratch & scratch, std::vector<int> seq_ids, std::vector<int> n_kv, int n_threads,
+              std::vector<gpt_kv_span> spans);
+
+    // position the graph after 'n_past' tokens of every sequence, whose pages are in 'pages'
+    void patch(const std::vector<int> & n_past, const gpt_kv_pages & pages);
+};
+
+// fill 'table' with the ALiBi biases of keys at the positions 0..n_ctx-1, n_ctx of them for every head;
+// the softmax of a query ignores what is the same for all of its keys, so the bias of a key only needs
+// its own position rather than the distance to the query
+void gpt_alibi_table(float * table, int n_ctx, int n_head, float bias_max);
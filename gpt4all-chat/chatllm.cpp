@@ -8,6 +8,8 @@
 #include <QCoreApplication>
 #include <QDir>
 #include <QFile>
+#include <QHash>
+#include <QPointer>
 #include <QProcess>
 #include <QResource>
 #include <QSettings>
@@ -43,21 +45,79 @@ static QString modelFilePath(const QString &modelName, bool isChatGPT)
     return QString();
 }
 
+// The store keeps the models that chats used last loaded, as long as they fit into a memory budget, so
+// that going back to one of them doesn't mean reading it from disk again. A model is only handed to one
+// chat at a time; the least recently used idle ones are evicted to make room, and models in use only once
+// they are released, so generation is never interrupted.
+static qint64 modelMemoryBudget()
+{
+    QSettings settings;
+    return settings.value("modelMemoryBudget", 8192).toLongLong() * 1024 * 1024;
+}
+
+// The kv cache of a model is split into slots that keep the contexts of the chats that used the model
+// last, within a memory budget, so that switching back to one of them only means picking its slot. The
+// context of a chat is only saved when it loses its slot, and then kept compressed in memory, or on disk
+// past the same budget.
+static qint64 kvCacheBudget()
+{
+    QSettings settings;
+    return settings.value("kvCacheBudget", 2048).toLongLong() * 1024 * 1024;
+}
+
+// The number of tokens in the context window models are loaded with, 0 for the one they were trained with.
+// Models already in the store keep theirs.
+static int32_t contextLength()
+{
+    QSettings settings;
+    return qMax(settings.value("contextLength", 0).toInt(), 0);
+}
+
 class LLModelStore {
 public:
     static LLModelStore *globalInstance();
 
-    LLModelInfo acquireModel(); // will block until llmodel is ready
+    // Will block until the model of the file is ready if another chat uses it. If it isn't loaded,
+    // the returned info has no model and the caller loads it.
+    LLModelInfo acquireModel(const QFileInfo &fileInfo);
     void releaseModel(const LLModelInfo &info); // must be called when you are done
 
+    // the following are only for the chat holding the model
+    void setupSlots(LLModel *model); // after loading a new model
+    int acquireSlot(const LLModelInfo &info, ChatLLM *chat, bool *resident); // resident if the slot still holds the chat's context
+
+    // The state of the context of a chat that lost its slot, once; false if there is none
+    bool takeEvictedState(ChatLLM *chat, QByteArray *state);
+    // The state of the context the slot of a chat holds while another chat or none has the model; false if
+    // the chat has no slot. Chats are only serialized when they aren't generating, so this doesn't wait
+    // for the model
+    bool saveResidentState(ChatLLM *chat, QByteArray *state);
+    void forgetChat(ChatLLM *chat); // when it is destroyed or its context doesn't matter anymore
+
+    bool reserveSpill(qint64 bytes);
+    void releaseSpill(qint64 bytes);
+
 private:
-    LLModelStore()
-    {
-        // seed with empty model
-        m_availableModels.append(LLModelInfo());
-    }
+    LLModelStore() {}
     ~LLModelStore() {}
-    QVector<LLModelInfo> m_availableModels;
+    struct Slot {
+        QPointer<ChatLLM> owner;
+        quint64 lastUse = 0;
+    };
+    struct Resident {
+        LLModelInfo info;
+        qint64 size = 0;      // memory the weights and the kv cache take
+        bool inUse = false;
+        quint64 lastUse = 0;
+        QVector<Slot> slots;
+    };
+    qint64 residentSize() const;
+    QVector<LLModel*> evict(qint64 needed); // returns the models to delete once the lock is released
+    void evictSlot(LLModel *model, int slot, Slot &s); // saves the context it holds for its owner
+    QVector<Resident> m_models;
+    QHash<ChatLLM*, QByteArray> m_evictedStates;
+    quint64 m_clock = 0;
+    qint64 m_spilledBytes = 0;
     QMutex m_mutex;
     QWaitCondition m_condition;
     friend class MyLLModelStore;
@@ -70,20 +130,205 @@ LLModelStore *LLModelStore::globalInstance()
     return storeInstance();
 }
 
-LLModelInfo LLModelStore::acquireModel()
+LLModelInfo LLModelStore::acquireModel(const QFileInfo &fileInfo)
 {
-    QMutexLocker locker(&m_mutex);
-    while (m_availableModels.isEmpty())
-        m_condition.wait(locker.mutex());
-    return m_availableModels.takeFirst();
+    QVector<LLModel*> evicted;
+    LLModelInfo info;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (;;) {
+            auto it = std::find_if(m_models.begin(), m_models.end(),
+                [&fileInfo](const Resident &r) { return r.info.fileInfo == fileInfo; });
+            if (it == m_models.end())
+                break;
+            if (!it->inUse) {
+                it->inUse = true;
+                it->lastUse = ++m_clock;
+                return it->info;
+            }
+            m_condition.wait(locker.mutex());
+        }
+
+        // make room for the model and claim it so other chats wait for it instead of loading it as well
+        evicted = evict(fileInfo.size());
+        Resident r;
+        r.info.fileInfo = fileInfo;
+        r.size = fileInfo.size();
+        r.inUse = true;
+        r.lastUse = ++m_clock;
+        m_models.append(r);
+        info.fileInfo = fileInfo;
+    }
+    qDeleteAll(evicted);
+    return info;
 }
 
 void LLModelStore::releaseModel(const LLModelInfo &info)
+{
+    QVector<LLModel*> evicted;
+    {
+        QMutexLocker locker(&m_mutex);
+        auto it = std::find_if(m_models.begin(), m_models.end(),
+            [&info](const Resident &r) { return r.inUse && r.info.fileInfo == info.fileInfo; });
+        Q_ASSERT(it != m_models.end());
+        if (it != m_models.end()) {
+            if (!info.model) {
+                // it failed to load
+                m_models.erase(it);
+            } else {
+                it->info = info;
+                it->size = info.fileInfo.size() + qint64(info.model->sequenceMemorySize()) * info.model->sequenceCount();
+                it->inUse = false;
+                it->lastUse = ++m_clock;
+            }
+        }
+        evicted = evict(0);
+        m_condition.wakeAll();
+    }
+    qDeleteAll(evicted);
+}
+
+qint64 LLModelStore::residentSize() const
+{
+    qint64 size = 0;
+    for (const Resident &r : m_models)
+        size += r.size;
+    return size;
+}
+
+QVector<LLModel*> LLModelStore::evict(qint64 needed)
+{
+    QVector<LLModel*> evicted;
+    const qint64 budget = modelMemoryBudget();
+    while (residentSize() + needed > budget) {
+        // the least recently used idle model, but always keep one around like a single model store would
+        auto victim = m_models.end();
+        for (auto it = m_models.begin(); it != m_models.end(); ++it) {
+            if (!it->inUse && (victim == m_models.end() || it->lastUse < victim->lastUse))
+                victim = it;
+        }
+        if (victim == m_models.end() || (!needed && m_models.count() < 2))
+            break;
+#if defined(DEBUG_MODEL_LOADING)
+        qDebug() << "evicting model" << victim->info.fileInfo.fileName() << victim->info.model;
+#endif
+        for (int i = 0; i < victim->slots.count(); ++i)
+            evictSlot(victim->info.model, i, victim->slots[i]);
+        evicted.append(victim->info.model);
+        m_models.erase(victim);
+    }
+    return evicted;
+}
+
+void LLModelStore::setupSlots(LLModel *model)
+{
+    const size_t slotSize = model->sequenceMemorySize();
+    const int n_slots = slotSize ? int(qBound(qint64(1), kvCacheBudget() / qint64(slotSize), qint64(8))) : 1;
+    if (!model->setSequenceCount(n_slots))
+        model->setSequenceCount(1);
+#if defined(DEBUG_MODEL_LOADING)
+    qDebug() << "kv cache slots" << model->sequenceCount() << "of" << slotSize << "bytes";
+#endif
+}
+
+int LLModelStore::acquireSlot(const LLModelInfo &info, ChatLLM *chat, bool *resident)
+{
+    QMutexLocker locker(&m_mutex);
+    *resident = false;
+    auto it = std::find_if(m_models.begin(), m_models.end(),
+        [&info](const Resident &r) { return r.inUse && r.info.fileInfo == info.fileInfo; });
+    if (it == m_models.end())
+        return 0;
+    it->info.model = info.model;
+    QVector<Slot> &slots = it->slots;
+    if (slots.count() != info.model->sequenceCount())
+        slots = QVector<Slot>(info.model->sequenceCount());
+
+    int slot = 0;
+    for (int i = 0; i < slots.count(); ++i) {
+        if (slots[i].owner == chat) {
+            slot = i;
+            *resident = true;
+            break;
+        }
+        // otherwise a free slot or else the least recently used one
+        if (slots[slot].owner && (!slots[i].owner || slots[i].lastUse < slots[slot].lastUse))
+            slot = i;
+    }
+
+    if (!*resident) {
+        evictSlot(info.model, slot, slots[slot]);
+        slots[slot].owner = chat;
+    }
+    slots[slot].lastUse = ++m_clock;
+    return slot;
+}
+
+void LLModelStore::evictSlot(LLModel *model, int slot, Slot &s)
+{
+    ChatLLM *owner = s.owner;
+    s.owner = nullptr;
+    if (!owner)
+        return;
+    QByteArray &state = m_evictedStates[owner];
+    state.resize(model->sequenceStateSize(slot, 0));
+    const size_t written = model->saveSequenceState(slot, static_cast<uint8_t*>(reinterpret_cast<void*>(state.data())), 0);
+    state.resize(written);
+    QMetaObject::invokeMethod(owner, &ChatLLM::handleSlotEvicted, Qt::QueuedConnection);
+}
+
+bool LLModelStore::takeEvictedState(ChatLLM *chat, QByteArray *state)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = m_evictedStates.find(chat);
+    if (it == m_evictedStates.end())
+        return false;
+    *state = std::move(*it);
+    m_evictedStates.erase(it);
+    return true;
+}
+
+bool LLModelStore::saveResidentState(ChatLLM *chat, QByteArray *state)
+{
+    QMutexLocker locker(&m_mutex);
+    for (const Resident &r : m_models) {
+        for (int i = 0; i < r.slots.count(); ++i) {
+            if (r.slots[i].owner != chat)
+                continue;
+            state->resize(r.info.model->sequenceStateSize(i, 0));
+            const size_t written = r.info.model->saveSequenceState(i, static_cast<uint8_t*>(reinterpret_cast<void*>(state->data())), 0);
+            state->resize(written);
+            return true;
+        }
+    }
+    return false;
+}
+
+void LLModelStore::forgetChat(ChatLLM *chat)
 {
     QMutexLocker locker(&m_mutex);
-    m_availableModels.append(info);
-    Q_ASSERT(m_availableModels.count() < 2);
-    m_condition.wakeAll();
+    m_evictedStates.remove(chat);
+    for (Resident &r : m_models) {
+        for (Slot &slot : r.slots) {
+            if (slot.owner == chat)
+                slot.owner = nullptr;
+        }
+    }
+}
+
+bool LLModelStore::reserveSpill(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_spilledBytes + bytes > kvCacheBudget())
+        return false;
+    m_spilledBytes += bytes;
+    return true;
+}
+
+void LLModelStore::releaseSpill(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_spilledBytes -= bytes;
 }
 
 ChatLLM::ChatLLM(Chat *parent, bool isServer)
@@ -124,6 +369,12 @@ ChatLLM::~ChatLLM()
         delete m_modelInfo.model;
         m_modelInfo.model = nullptr;
     }
+
+    if (!storeInstance.isDestroyed()) {
+        if (m_stateCompressed)
+            LLModelStore::globalInstance()->releaseSpill(m_state.size());
+        LLModelStore::globalInstance()->forgetChat(this);
+    }
 }
 
 void ChatLLM::handleThreadStarted()
@@ -164,17 +415,29 @@ bool ChatLLM::loadModel(const QString &modelName)
     bool alreadyAcquired = isModelLoaded();
     if (alreadyAcquired) {
         resetContext();
+        if (m_isServer) {
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "already acquired model deleted" << m_llmThread.objectName() << m_modelInfo.model;
+            qDebug() << "already acquired model deleted" << m_llmThread.objectName() << m_modelInfo.model;
 #endif
-        delete m_modelInfo.model;
-        m_modelInfo.model = nullptr;
+            delete m_modelInfo.model;
+        } else {
+            // it stays loaded in the store for as long as the memory budget allows
+#if defined(DEBUG_MODEL_LOADING)
+            qDebug() << "already acquired model released" << m_llmThread.objectName() << m_modelInfo.model;
+#endif
+            LLModelStore::globalInstance()->releaseModel(m_modelInfo);
+            // its kv cache slot holds a context that was reset
+            LLModelStore::globalInstance()->forgetChat(this);
+        }
+        m_modelInfo = LLModelInfo();
         emit isModelLoadedChanged(false);
-    } else if (!m_isServer) {
+    }
+
+    if (!m_isServer) {
         // This is a blocking call that tries to retrieve the model we need from the model store.
-        // If it succeeds, then we just have to restore state. If the store has never had a model
-        // returned to it, then the modelInfo.model pointer should be null which will happen on startup
-        m_modelInfo = LLModelStore::globalInstance()->acquireModel();
+        // If it succeeds, then we just have to restore state. If the model isn't loaded, the
+        // modelInfo.model pointer is null and we load it below
+        m_modelInfo = LLModelStore::globalInstance()->acquireModel(fileInfo);
 #if defined(DEBUG_MODEL_LOADING)
         qDebug() << "acquired model from store" << m_llmThread.objectName() << m_modelInfo.model;
 #endif
@@ -192,24 +455,32 @@ bool ChatLLM::loadModel(const QString &modelName)
         }
 
         // Check if the store just gave us exactly the model we were looking for
-        if (m_modelInfo.model && m_modelInfo.fileInfo == fileInfo) {
+        if (m_modelInfo.model) {
 #if defined(DEBUG_MODEL_LOADING)
             qDebug() << "store had our model" << m_llmThread.objectName() << m_modelInfo.model;
 #endif
+            // another chat may have loaded it
+            if (isChatGPT) {
+                m_modelType = LLModelType::CHATGPT_;
+            } else {
+                switch (m_modelInfo.model->implementation().modelType[0]) {
+                case 'L': m_modelType = LLModelType::LLAMA_; break;
+                case 'G': m_modelType = LLModelType::GPTJ_; break;
+                case 'M': m_modelType = LLModelType::MPT_; break;
+                case 'R': m_modelType = LLModelType::REPLIT_; break;
+                }
+            }
+            QString basename = fileInfo.completeBaseName();
+            if (basename.startsWith("ggml-")) // remove the ggml- prefix
+                basename.remove(0, 5);
+            setModelName(basename);
             restoreState();
             emit isModelLoadedChanged(true);
             return true;
-        } else {
-            // Release the memory since we have to switch to a different model.
-#if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "deleting model" << m_llmThread.objectName() << m_modelInfo.model;
-#endif
-            delete m_modelInfo.model;
-            m_modelInfo.model = nullptr;
         }
     }
 
-    // Guarantee we've released the previous models memory
+    // Guarantee we don't hold on to a previous model
     Q_ASSERT(!m_modelInfo.model);
 
     // Store the file info in the modelInfo in case we have an error loading
@@ -234,6 +505,9 @@ bool ChatLLM::loadModel(const QString &modelName)
         } else {
             m_modelInfo.model = LLModel::construct(filePath.toStdString());
             if (m_modelInfo.model) {
+                LLModel::LoadOptions options = m_modelInfo.model->loadOptions();
+                options.n_ctx = contextLength();
+                m_modelInfo.model->setLoadOptions(options);
                 bool success = m_modelInfo.model->loadModel(filePath.toStdString());
                 if (!success) {
                     delete std::exchange(m_modelInfo.model, nullptr);
@@ -267,6 +541,8 @@ bool ChatLLM::loadModel(const QString &modelName)
 #if defined(DEBUG_MODEL_LOADING)
         qDebug() << "new model" << m_llmThread.objectName() << m_modelInfo.model;
 #endif
+        if (isModelLoaded() && !m_isServer && m_modelType != LLModelType::CHATGPT_)
+            LLModelStore::globalInstance()->setupSlots(m_modelInfo.model);
         restoreState();
 #if defined(DEBUG)
         qDebug() << "modelLoadedChanged" << m_llmThread.objectName();
@@ -330,6 +606,15 @@ void ChatLLM::resetContext()
 {
     regenerateResponse();
     m_ctx = LLModel::PromptContext();
+    clearState();
+}
+
+void ChatLLM::rewindContext()
+{
+    // Start over without forgetting which tokens are in the kv cache, so the next prompt only has to
+    // evaluate the part that differs from the previous one
+    resetResponse();
+    m_ctx.n_past = 0;
 }
 
 std::string remove_leading_whitespace(const std::string& input) {
@@ -419,26 +704,32 @@ bool ChatLLM::handleRecalculate(bool isRecalc)
     return !m_stopGenerating;
 }
 
-bool ChatLLM::prompt(const QList<QString> &collectionList, const QString &prompt, const QString &prompt_template, int32_t n_predict, int32_t top_k,
-    float top_p, float temp, int32_t n_batch, float repeat_penalty, int32_t repeat_penalty_tokens, int n_threads)
+QString ChatLLM::augmentedPrompt(const QList<QString> &collectionList, const QString &prompt,
+    const QString &prompt_template, QList<ResultInfo> *databaseResults)
 {
-    if (!isModelLoaded())
-        return false;
-
-    QList<ResultInfo> databaseResults;
     const int retrievalSize = LocalDocs::globalInstance()->retrievalSize();
-    emit requestRetrieveFromDB(collectionList, prompt, retrievalSize, &databaseResults); // blocks
-    emit databaseResultsChanged(databaseResults);
+    emit requestRetrieveFromDB(collectionList, prompt, retrievalSize, databaseResults); // blocks
+    emit databaseResultsChanged(*databaseResults);
 
     // Augment the prompt template with the results if any
     QList<QString> augmentedTemplate;
-    if (!databaseResults.isEmpty())
+    if (!databaseResults->isEmpty())
         augmentedTemplate.append("### Context:");
-    for (const ResultInfo &info : databaseResults)
+    for (const ResultInfo &info : *databaseResults)
         augmentedTemplate.append(info.text);
     augmentedTemplate.append(prompt_template);
 
-    QString instructPrompt = augmentedTemplate.join("\n").arg(prompt);
+    return augmentedTemplate.join("\n").arg(prompt);
+}
+
+bool ChatLLM::prompt(const QList<QString> &collectionList, const QString &prompt, const QString &prompt_template, int32_t n_predict, int32_t top_k,
+    float top_p, float temp, int32_t n_batch, float repeat_penalty, int32_t repeat_penalty_tokens, int n_threads)
+{
+    if (!isModelLoaded())
+        return false;
+
+    QList<ResultInfo> databaseResults;
+    QString instructPrompt = augmentedPrompt(collectionList, prompt, prompt_template, &databaseResults);
 
     m_stopGenerating = false;
     auto promptFunc = std::bind(&ChatLLM::handlePrompt, this, std::placeholders::_1);
@@ -455,6 +746,8 @@ bool ChatLLM::prompt(const QList<QString> &collectionList, const QString &prompt
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
     m_modelInfo.model->setThreadCount(n_threads);
+    // answers grounded in LocalDocs context tend to quote it, so let the model copy spans of it ahead
+    m_modelInfo.model->setPromptLookup(databaseResults.isEmpty() ? 0 : 4);
 #if defined(DEBUG)
     printf("%s", qPrintable(instructPrompt));
     fflush(stdout);
@@ -475,6 +768,98 @@ bool ChatLLM::prompt(const QList<QString> &collectionList, const QString &prompt
     return true;
 }
 
+bool ChatLLM::promptBranches(const QList<QString> &collectionList, const QString &prompt, const QString &prompt_template,
+    int32_t n, int32_t n_predict, int32_t top_k, float top_p, float temp, int32_t n_batch, float repeat_penalty,
+    int32_t repeat_penalty_tokens, int32_t n_threads, QList<QString> *responses)
+{
+    if (!isModelLoaded() || m_modelType == LLModelType::CHATGPT_ || n < 2)
+        return false;
+
+    // The prompt keeps a sequence of its own that the branches are forked from, so that it is still
+    // there for the next round of branches and for the next prompt to start from
+    LLModel *model = m_modelInfo.model;
+    const int32_t n_seq = std::min(n + 1, 8);
+    if (model->sequenceCount() < n_seq) {
+        if (!model->setSequenceCount(n_seq))
+            return false;
+        // that discarded the kv cache
+        m_ctx.tokens.clear();
+        m_ctx.n_past = 0;
+    }
+    QVector<int32_t> branchIds;
+    for (int32_t id = 0; id < model->sequenceCount(); ++id) {
+        if (id != m_ctx.seq_id)
+            branchIds.append(id);
+    }
+
+    QList<ResultInfo> databaseResults;
+    const QString instructPrompt = augmentedPrompt(collectionList, prompt, prompt_template, &databaseResults);
+
+    m_stopGenerating = false;
+    emit promptProcessing();
+    m_ctx.n_predict = n_predict;
+    m_ctx.top_k = top_k;
+    m_ctx.top_p = top_p;
+    m_ctx.temp = temp;
+    m_ctx.n_batch = n_batch;
+    m_ctx.repeat_penalty = repeat_penalty;
+    m_ctx.repeat_last_n = repeat_penalty_tokens;
+    model->setThreadCount(n_threads);
+#if defined(DEBUG)
+    printf("%s", qPrintable(instructPrompt));
+    fflush(stdout);
+#endif
+    m_timer->start();
+
+    // whatever fails leaves the prompt in the kv cache for the caller to fall back to 'prompt' with
+    const auto fail = [this]() {
+        m_timer->stop();
+        rewindContext();
+        return false;
+    };
+
+    LLModel::BatchSequence root;
+    root.ctx = &m_ctx;
+    if (!model->beginSequence(root, instructPrompt.toStdString(),
+            std::bind(&ChatLLM::handlePrompt, this, std::placeholders::_1)))
+        return fail();
+
+    QList<QString> results;
+    while (results.size() < n) {
+        const int n_branches = std::min(n - int(results.size()), int(branchIds.size()));
+        std::vector<LLModel::PromptContext> ctxs(n_branches);
+        std::vector<LLModel::BatchSequence> branches(n_branches);
+        std::vector<std::string> texts(n_branches);
+        std::vector<LLModel::BatchSequence*> batch;
+        for (int i = 0; i < n_branches; ++i) {
+            ctxs[i].seq_id = branchIds[i];
+            branches[i].ctx = &ctxs[i];
+            branches[i].responseCallback = [this, &text = texts[i]](int32_t token, const std::string &response) {
+                text.append(response);
+                // check for error
+                if (token < 0)
+                    return false;
+                ++m_promptResponseTokens;
+                m_timer->inc();
+                return !m_stopGenerating;
+            };
+            if (!model->beginSequenceFrom(branches[i], root))
+                return fail();
+            batch.push_back(&branches[i]);
+        }
+
+        while (model->decodeBatch(batch)) {}
+
+        for (const std::string &text : texts)
+            results.append(QString::fromStdString(trim_whitespace(text)));
+    }
+
+    m_timer->stop();
+    *responses = results;
+    emit responseStopped();
+    return true;
+}
+
 void ChatLLM::setShouldBeLoaded(bool b)
 {
 #if defined(DEBUG_MODEL_LOADING)
@@ -503,7 +888,11 @@ void ChatLLM::unloadModel()
     if (!isModelLoaded() || m_isServer)
         return;
 
-    saveState();
+    // the kv cache slot of the chat keeps its context, which the store saves if the slot goes to another chat
+    if (m_modelType == LLModelType::CHATGPT_)
+        saveState();
+    else
+        m_stateInSlot = true;
 #if defined(DEBUG_MODEL_LOADING)
     qDebug() << "unloadModel" << m_llmThread.objectName() << m_modelInfo.model;
 #endif
@@ -594,6 +983,18 @@ bool ChatLLM::handleNameRecalculate(bool isRecalc)
 
 bool ChatLLM::serialize(QDataStream &stream, int version)
 {
+    if (m_stateInSlot && !isModelLoaded()) {
+        QByteArray state;
+        if (LLModelStore::globalInstance()->takeEvictedState(this, &state)
+                || LLModelStore::globalInstance()->saveResidentState(this, &state)) {
+            setSlotState(state);
+        } else {
+            // the context is gone with the slot, so the chat starts over
+            clearState();
+            m_ctx.n_past = 0;
+            m_ctx.tokens.clear();
+        }
+    }
     if (version > 1) {
         stream << m_modelType;
         switch (m_modelType) {
@@ -617,7 +1018,13 @@ bool ChatLLM::serialize(QDataStream &stream, int version)
     stream << quint64(m_ctx.tokens.size());
     stream.writeRawData(reinterpret_cast<const char*>(m_ctx.tokens.data()), m_ctx.tokens.size() * sizeof(int));
     saveState();
-    QByteArray compressed = qCompress(m_state);
+    QByteArray compressed;
+    if (m_stateSpillFile) {
+        m_stateSpillFile->seek(0);
+        compressed = m_stateSpillFile->readAll();
+    } else {
+        compressed = m_stateCompressed ? m_state : qCompress(m_state);
+    }
     stream << compressed;
 #if defined(DEBUG)
     qDebug() << "serialize" << m_llmThread.objectName() << m_state.size();
@@ -652,13 +1059,17 @@ bool ChatLLM::deserialize(QDataStream &stream, int version)
     stream >> tokensSize;
     m_ctx.tokens.resize(tokensSize);
     stream.readRawData(reinterpret_cast<char*>(m_ctx.tokens.data()), tokensSize * sizeof(int));
+    clearState();
     if (version > 0) {
+        // kept compressed until the chat gets a kv cache slot
         QByteArray compressed;
         stream >> compressed;
-        m_state = qUncompress(compressed);
+        spillState(compressed);
     } else {
         stream >> m_state;
     }
+    // the state was saved right before the tokens were
+    m_stateTokens = m_ctx.tokens;
 #if defined(DEBUG)
     qDebug() << "deserialize" << m_llmThread.objectName();
 #endif
@@ -669,6 +1080,7 @@ void ChatLLM::saveState()
 {
     if (!isModelLoaded())
         return;
+    unspillState();
 
     if (m_modelType == LLModelType::CHATGPT_) {
         m_state.clear();
@@ -679,20 +1091,52 @@ void ChatLLM::saveState()
         return;
     }
 
-    const size_t stateSize = m_modelInfo.model->stateSize();
+    // If the conversation only grew since the state was last saved, append just what was added to the
+    // kv cache since then. Past a few increments the state is written anew so restoring it stays cheap.
+    const std::vector<int32_t> &tokens = m_ctx.tokens;
+    const size_t n_from = m_stateTokens.size();
+    const bool appendOnly = !m_state.isEmpty() && n_from <= tokens.size()
+        && std::equal(m_stateTokens.begin(), m_stateTokens.end(), tokens.begin());
+    if (appendOnly && n_from == tokens.size())
+        return;
+    if (appendOnly && m_stateIncrements < 16) {
+        const size_t incrementSize = m_modelInfo.model->sequenceStateSize(m_ctx.seq_id, n_from);
+        if (incrementSize) {
+            const qsizetype offset = m_state.size();
+            m_state.resize(offset + incrementSize);
+            const size_t written = m_modelInfo.model->saveSequenceState(m_ctx.seq_id,
+                static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data() + offset)), n_from);
+            m_state.resize(offset + written);
+            m_stateTokens = tokens;
+            ++m_stateIncrements;
+#if defined(DEBUG)
+            qDebug() << "saveState" << m_llmThread.objectName() << "increment:" << written << "size:" << m_state.size();
+#endif
+            return;
+        }
+    }
+
+    const size_t stateSize = m_modelInfo.model->sequenceStateSize(m_ctx.seq_id, 0);
     m_state.resize(stateSize);
+    const size_t written = m_modelInfo.model->saveSequenceState(m_ctx.seq_id,
+        static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data())), 0);
+    m_state.resize(written);
+    m_stateTokens = tokens;
+    m_stateIncrements = 0;
 #if defined(DEBUG)
     qDebug() << "saveState" << m_llmThread.objectName() << "size:" << m_state.size();
 #endif
-    m_modelInfo.model->saveState(static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data())));
 }
 
 void ChatLLM::restoreState()
 {
-    if (!isModelLoaded() || m_state.isEmpty())
+    if (!isModelLoaded())
         return;
 
     if (m_modelType == LLModelType::CHATGPT_) {
+        unspillState();
+        if (m_state.isEmpty())
+            return;
         QDataStream stream(&m_state, QIODeviceBase::ReadOnly);
         stream.setVersion(QDataStream::Qt_6_5);
         ChatGPT *chatGPT = static_cast<ChatGPT*>(m_modelInfo.model);
@@ -704,10 +1148,114 @@ void ChatLLM::restoreState()
         return;
     }
 
+    // nothing to do if the kv cache slot of the chat still holds its context
+    bool resident = false;
+    if (!m_isServer)
+        m_ctx.seq_id = LLModelStore::globalInstance()->acquireSlot(m_modelInfo, this, &resident);
+    if (resident) {
+        m_stateInSlot = false;
+        return;
+    }
+
+    // otherwise the store saved the context when the slot went to another chat
+    if (m_stateInSlot) {
+        QByteArray state;
+        if (LLModelStore::globalInstance()->takeEvictedState(this, &state)) {
+            setSlotState(state);
+        } else {
+            qWarning() << "ERROR: The model state of" << m_llmThread.objectName() << "was lost with its slot";
+            clearState();
+            m_ctx.n_past = 0;
+            m_ctx.tokens.clear();
+        }
+    }
+
+    unspillState();
+    if (m_state.isEmpty())
+        return;
+
 #if defined(DEBUG)
-    qDebug() << "restoreState" << m_llmThread.objectName() << "size:" << m_state.size();
+    qDebug() << "restoreState" << m_llmThread.objectName() << "size:" << m_state.size() << "slot:" << m_ctx.seq_id;
 #endif
-    m_modelInfo.model->restoreState(static_cast<const uint8_t*>(reinterpret_cast<void*>(m_state.data())));
+    // the full state and then every increment in the order they were saved; the state is kept so that
+    // the next save only has to append what gets added from now on
+    const uint8_t *data = static_cast<const uint8_t*>(reinterpret_cast<void*>(m_state.data()));
+    size_t offset = 0;
+    while (offset < size_t(m_state.size())) {
+        const size_t read = m_modelInfo.model->restoreSequenceState(m_ctx.seq_id, data + offset);
+        if (!read)
+            break;
+        offset += read;
+    }
+    if (offset < size_t(m_state.size())) {
+        // the kv cache doesn't hold the context, so start over rather than attend to whatever is in it
+        qWarning() << "ERROR: Could not restore the model state of" << m_llmThread.objectName();
+        clearState();
+        m_ctx.n_past = 0;
+        m_ctx.tokens.clear();
+    }
+}
+
+void ChatLLM::clearState()
+{
+    unspillState();
+    m_state.clear();
+    m_stateTokens.clear();
+    m_stateIncrements = 0;
+    m_stateInSlot = false;
+}
+
+// the state the store saved from the kv cache slot of the chat, which holds the context as it was when the
+// chat released the model
+void ChatLLM::setSlotState(const QByteArray &state)
+{
+    clearState();
+    m_state = state;
+    m_stateTokens = m_ctx.tokens;
+}
+
+// keep the state compressed, on disk if the ones of other chats already take up the budget
+void ChatLLM::spillState(const QByteArray &compressed)
+{
+    Q_ASSERT(!m_stateCompressed && !m_stateSpillFile);
+    if (LLModelStore::globalInstance()->reserveSpill(compressed.size())) {
+        m_state = compressed;
+        m_stateCompressed = true;
+        return;
+    }
+
+    auto file = std::make_unique<QTemporaryFile>(QDir::tempPath() + "/gpt4all-state-XXXXXX");
+    if (file->open() && file->write(compressed) == compressed.size() && file->flush()) {
+        m_state.clear();
+        m_stateSpillFile = std::move(file);
+        return;
+    }
+    qWarning() << "ERROR: Could not spill the model state to" << file->fileName();
+    m_state = qUncompress(compressed);
+}
+
+void ChatLLM::unspillState()
+{
+    if (m_stateSpillFile) {
+        m_stateSpillFile->seek(0);
+        m_state = qUncompress(m_stateSpillFile->readAll());
+        m_stateSpillFile.reset();
+    } else if (m_stateCompressed) {
+        LLModelStore::globalInstance()->releaseSpill(m_state.size());
+        m_state = qUncompress(m_state);
+        m_stateCompressed = false;
+    }
+}
+
+void ChatLLM::handleSlotEvicted()
+{
+    // the chat may have taken the state already when it got a slot again, and doesn't need it if it has
+    // switched to another model meanwhile
+    QByteArray state;
+    if (!LLModelStore::globalInstance()->takeEvictedState(this, &state) || isModelLoaded() || !m_stateInSlot)
+        return;
+    setSlotState(state);
+    const QByteArray compressed = qCompress(m_state);
     m_state.clear();
-    m_state.resize(0);
+    spillState(compressed);
 }
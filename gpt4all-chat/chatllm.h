@@ -4,6 +4,9 @@
 #include <QObject>
 #include <QThread>
 #include <QFileInfo>
+#include <QTemporaryFile>
+
+#include <memory>
 
 #include "localdocs.h"
 #include "../gpt4all-backend/llmodel.h"
@@ -81,9 +84,16 @@ public:
     void regenerateResponse();
     void resetResponse();
     void resetContext();
+    void rewindContext();
 
     void stopGenerating() { m_stopGenerating = true; }
 
+    // Samples 'n' responses to one evaluation of the prompt by forking its sequence in the kv cache and
+    // decoding the forks together. False if the model can't do that, in which case 'prompt' still can
+    bool promptBranches(const QList<QString> &collectionList, const QString &prompt, const QString &prompt_template,
+        int32_t n, int32_t n_predict, int32_t top_k, float top_p, float temp, int32_t n_batch, float repeat_penalty,
+        int32_t repeat_penalty_tokens, int32_t n_threads, QList<QString> *responses);
+
     bool shouldBeLoaded() const { return m_shouldBeLoaded; }
     void setShouldBeLoaded(bool b);
 
@@ -114,6 +124,7 @@ public Q_SLOTS:
     void handleDefaultModelChanged(const QString &defaultModel);
     void handleShouldBeLoadedChanged();
     void handleThreadStarted();
+    void handleSlotEvicted();
 
 Q_SIGNALS:
     void isModelLoadedChanged(bool);
@@ -140,8 +151,14 @@ protected:
     bool handleNamePrompt(int32_t token);
     bool handleNameResponse(int32_t token, const std::string &response);
     bool handleNameRecalculate(bool isRecalc);
+    QString augmentedPrompt(const QList<QString> &collectionList, const QString &prompt,
+        const QString &prompt_template, QList<ResultInfo> *databaseResults);
     void saveState();
     void restoreState();
+    void clearState();
+    void setSlotState(const QByteArray &state);
+    void spillState(const QByteArray &compressed);
+    void unspillState();
 
 protected:
     LLModel::PromptContext m_ctx;
@@ -156,7 +173,12 @@ private:
     QString m_modelName;
     QString m_defaultModel;
     TokenTimer *m_timer;
-    QByteArray m_state;
+    QByteArray m_state;                 // a full model state followed by the increments saved after it
+    std::vector<int32_t> m_stateTokens; // the tokens whose kv cache entries m_state holds
+    int m_stateIncrements = 0;
+    bool m_stateInSlot = false;         // the kv cache slot of the chat holds a newer context than m_state
+    bool m_stateCompressed = false;     // m_state is compressed while the chat has no kv cache slot
+    std::unique_ptr<QTemporaryFile> m_stateSpillFile; // or written here if that would take too much memory
     QThread m_llmThread;
     std::atomic<bool> m_stopGenerating;
     std::atomic<bool> m_shouldBeLoaded;
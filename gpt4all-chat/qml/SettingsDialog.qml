@@ -41,6 +41,7 @@ Dialog {
     property real defaultRepeatPenalty: 1.18
     property int defaultRepeatPenaltyTokens: 64
     property int defaultThreadCount: 0
+    property int defaultContextLength: 0
     property bool defaultSaveChats: false
     property bool defaultSaveChatGPTChats: true
     property bool defaultServerChat: false
@@ -59,6 +60,7 @@ Dialog {
     property alias repeatPenalty: settings.repeatPenalty
     property alias repeatPenaltyTokens: settings.repeatPenaltyTokens
     property alias threadCount: settings.threadCount
+    property alias contextLength: settings.contextLength
     property alias saveChats: settings.saveChats
     property alias saveChatGPTChats: settings.saveChatGPTChats
     property alias serverChat: settings.serverChat
@@ -73,6 +75,7 @@ Dialog {
         property int maxLength: settingsDialog.defaultMaxLength
         property int promptBatchSize: settingsDialog.defaultPromptBatchSize
         property int threadCount: settingsDialog.defaultThreadCount
+        property int contextLength: settingsDialog.defaultContextLength
         property bool saveChats: settingsDialog.defaultSaveChats
         property bool saveChatGPTChats: settingsDialog.defaultSaveChatGPTChats
         property bool serverChat: settingsDialog.defaultServerChat
@@ -98,6 +101,7 @@ Dialog {
     function restoreApplicationDefaults() {
         settings.modelPath = settingsDialog.defaultModelPath
         settings.threadCount = defaultThreadCount
+        settings.contextLength = defaultContextLength
         settings.saveChats = defaultSaveChats
         settings.saveChatGPTChats = defaultSaveChatGPTChats
         settings.serverChat = defaultServerChat
@@ -726,16 +730,47 @@ Dialog {
                         Accessible.name: nThreadsLabel.text
                         Accessible.description: ToolTip.text
                     }
+                    Label {
+                        id: contextLengthLabel
+                        text: qsTr("Context Length:")
+                        color: theme.textColor
+                        Layout.row: 4
+                        Layout.column: 0
+                    }
+                    MyTextField {
+                        text: settingsDialog.contextLength.toString()
+                        color: theme.textColor
+                        ToolTip.text: qsTr("Maximum number of tokens in a conversation, a setting of 0 will use the one the model was trained with. Takes effect the next time a model is loaded")
+                        ToolTip.visible: hovered
+                        Layout.row: 4
+                        Layout.column: 1
+                        validator: IntValidator {
+                            bottom: 0
+                        }
+                        onEditingFinished: {
+                            var val = parseInt(text)
+                            if (!isNaN(val)) {
+                                settingsDialog.contextLength = val
+                                settings.sync()
+                                focus = false
+                            } else {
+                                text = settingsDialog.contextLength.toString()
+                            }
+                        }
+                        Accessible.role: Accessible.EditableText
+                        Accessible.name: contextLengthLabel.text
+                        Accessible.description: ToolTip.text
+                    }
                     Label {
                         id: saveChatsLabel
                         text: qsTr("Save chats to disk:")
                         color: theme.textColor
-                        Layout.row: 4
+                        Layout.row: 5
                         Layout.column: 0
                     }
                     MyCheckBox {
                         id: saveChatsBox
-                        Layout.row: 4
+                        Layout.row: 5
                         Layout.column: 1
                         checked: settingsDialog.saveChats
                         onClicked: {
@@ -751,12 +786,12 @@ Dialog {
                         id: saveChatGPTChatsLabel
                         text: qsTr("Save ChatGPT chats to disk:")
                         color: theme.textColor
-                        Layout.row: 5
+                        Layout.row: 6
                         Layout.column: 0
                     }
                     MyCheckBox {
                         id: saveChatGPTChatsBox
-                        Layout.row: 5
+                        Layout.row: 6
                         Layout.column: 1
                         checked: settingsDialog.saveChatGPTChats
                         onClicked: {
@@ -769,12 +804,12 @@ Dialog {
                         id: serverChatLabel
                         text: qsTr("Enable web server:")
                         color: theme.textColor
-                        Layout.row: 6
+                        Layout.row: 7
                         Layout.column: 0
                     }
                     MyCheckBox {
                         id: serverChatBox
-                        Layout.row: 6
+                        Layout.row: 7
                         Layout.column: 1
                         checked: settings.serverChat
                         onClicked: {
@@ -786,7 +821,7 @@ Dialog {
                         ToolTip.visible: hovered
                     }
                     MyButton {
-                        Layout.row: 7
+                        Layout.row: 8
                         Layout.column: 1
                         Layout.fillWidth: true
                         text: qsTr("Restore Defaults")
@@ -229,9 +229,6 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     if (body.contains("echo"))
         echo = body["echo"].toBool();
 
-    // We currently don't support any of the following...
-#if 0
-    // FIXME: Need configurable reverse prompts
     QList<QString> stop;
     if (body.contains("stop")) {
         QJsonValue stopValue = body["stop"];
@@ -244,6 +241,23 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
         }
     }
 
+    float presence_penalty = 0.f;
+    if (body.contains("presence_penalty"))
+        presence_penalty = body["presence_penalty"].toDouble();
+
+    float frequency_penalty = 0.f;
+    if (body.contains("frequency_penalty"))
+        frequency_penalty = body["frequency_penalty"].toDouble();
+
+    std::vector<std::pair<int32_t, float>> logit_bias;
+    if (body.contains("logit_bias")) {
+        const QJsonObject biases = body["logit_bias"].toObject();
+        for (auto it = biases.constBegin(); it != biases.constEnd(); ++it)
+            logit_bias.push_back({ it.key().toInt(), float(it.value().toDouble()) });
+    }
+
+    // We currently don't support any of the following...
+#if 0
     // FIXME: QHttpServer doesn't support server-sent events
     bool stream = false;
     if (body.contains("stream"))
@@ -254,16 +268,6 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     if (body.contains("suffix"))
         suffix = body["suffix"].toString();
 
-    // FIXME: We don't support
-    float presence_penalty = 0.f;
-    if (body.contains("presence_penalty"))
-        top_p = body["presence_penalty"].toDouble();
-
-    // FIXME: We don't support
-    float frequency_penalty = 0.f;
-    if (body.contains("frequency_penalty"))
-        top_p = body["frequency_penalty"].toDouble();
-
     // FIXME: We don't support
     int best_of = 1;
     if (body.contains("best_of"))
@@ -306,8 +310,17 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
         return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
     }
 
-    // don't remember any context
-    resetContext();
+    // don't remember any context, but let a prompt sharing a template with the last one reuse its kv cache
+    rewindContext();
+
+    // the request's stop sequences apply in addition to the reverse prompts of the templates
+    m_ctx.stopSequences = LLModel::PromptContext().stopSequences;
+    for (const QString &s : stop)
+        m_ctx.stopSequences.push_back(s.toStdString());
+
+    m_ctx.presence_penalty = presence_penalty;
+    m_ctx.frequency_penalty = frequency_penalty;
+    m_ctx.logitBias = logit_bias;
 
     QSettings settings;
     settings.sync();
@@ -320,32 +333,55 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     int promptTokens = 0;
     int responseTokens = 0;
     QList<QPair<QString, QList<ResultInfo>>> responses;
-    for (int i = 0; i < n; ++i) {
-        if (!prompt(
-            m_collections,
-            actualPrompt,
-            promptTemplate,
-            max_tokens /*n_predict*/,
-            top_k,
-            top_p,
-            temperature,
-            n_batch,
-            repeat_penalty,
-            repeat_last_n,
-            LLM::globalInstance()->threadCount())) {
-
-            std::cerr << "ERROR: couldn't prompt model " << model.toStdString() << std::endl;
-            return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+    // several responses share one evaluation of the prompt and are decoded together if the model can
+    QList<QString> branches;
+    if (n > 1 && promptBranches(
+        m_collections,
+        actualPrompt,
+        promptTemplate,
+        n,
+        max_tokens /*n_predict*/,
+        top_k,
+        top_p,
+        temperature,
+        n_batch,
+        repeat_penalty,
+        repeat_last_n,
+        LLM::globalInstance()->threadCount(),
+        &branches)) {
+
+        for (const QString &branch : branches)
+            responses.append(qMakePair((echo ? QString("%1\n").arg(actualPrompt) : QString()) + branch, m_databaseResults));
+        promptTokens = m_promptTokens;
+        responseTokens = m_promptResponseTokens - m_promptTokens;
+    } else {
+        for (int i = 0; i < n; ++i) {
+            if (!prompt(
+                m_collections,
+                actualPrompt,
+                promptTemplate,
+                max_tokens /*n_predict*/,
+                top_k,
+                top_p,
+                temperature,
+                n_batch,
+                repeat_penalty,
+                repeat_last_n,
+                LLM::globalInstance()->threadCount())) {
+
+                std::cerr << "ERROR: couldn't prompt model " << model.toStdString() << std::endl;
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+            }
+            QString echoedPrompt = actualPrompt;
+            if (!echoedPrompt.endsWith("\n"))
+                echoedPrompt += "\n";
+            responses.append(qMakePair((echo ? QString("%1\n").arg(actualPrompt) : QString()) + response(), m_databaseResults));
+            if (!promptTokens)
+                promptTokens += m_promptTokens;
+            responseTokens += m_promptResponseTokens - m_promptTokens;
+            if (i != n - 1)
+                resetResponse();
         }
-        QString echoedPrompt = actualPrompt;
-        if (!echoedPrompt.endsWith("\n"))
-            echoedPrompt += "\n";
-        responses.append(qMakePair((echo ? QString("%1\n").arg(actualPrompt) : QString()) + response(), m_databaseResults));
-        if (!promptTokens)
-            promptTokens += m_promptTokens;
-        responseTokens += m_promptResponseTokens - m_promptTokens;
-        if (i != n - 1)
-            resetResponse();
     }
 
     QJsonObject responseObject;